@@ -0,0 +1,181 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "src/sparseDim.tpp"
+#include "src/multiDim.tpp"
+#include "src/sparseMatrix.tpp"
+#include "generators.h"
+
+/*
+ Timings of the main operations over a few densities and dimensions.
+ Build: g++ -std=c++14 -O2 -pthread -I<patch dir> benchdsutil.cpp -o benchdsutil
+ where <patch dir> holds patch/patch.hpp (see README).
+ Add -DMDSPARSE_COUNTERS to also get the hot path counters of SparseDim
+ (shifts per op, average row length searched, allocations, bytes written).
+ Run: ./benchdsutil [scale], scale multiplies get/set counts (default 1).
+ */
+
+using namespace std;
+
+static int scale = 1;
+static volatile long sink;
+
+struct Timer {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+    double ms() const {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - t0)
+                .count();
+    }
+};
+
+struct foo7 {
+    void operator()(int& i) {
+        i *= 7;
+    }
+};
+
+template<int N>
+string dimsName(const array<int, N> &dims) {
+    string name;
+    for (int i = 0; i < N; i++) {
+        name += (i ? "x" : "") + to_string(dims[i]);
+    }
+    return name;
+}
+
+void report(const string &what, const string &dims, int density, size_t ops,
+        double ms, const PerfCounters &c = PerfCounters { 0, 0, 0, 0, 0 }) {
+    printf("%-10s %-14s %3d%% %10zu ops %9.2f ms %9.1f ns/op", what.c_str(),
+            dims.c_str(), density, ops, ms, ops ? ms * 1e6 / ops : 0.0);
+#ifdef MDSPARSE_COUNTERS
+    printf(" | shifts/op %8.1f probe %6.1f allocs %8llu bytes %10llu",
+            ops ? (double) c.shifts / ops : 0.0,
+            c.probes ? (double) c.probelen / c.probes : 0.0,
+            (unsigned long long) c.allocations,
+            (unsigned long long) c.byteswritten);
+#else
+    (void) c;
+#endif
+    printf("\n");
+}
+
+template<int N>
+void benchND(array<int, N> dims, int density) {
+    string name = dimsName<N>(dims);
+    size_t cells = 1;
+    for (int d : dims) {
+        cells *= d;
+    }
+
+    // Same values for every layout, generated before timing
+    size_t nset = max<size_t>(cells * density / 100, 1) * scale;
+    vector<array<int, N> > where(nset);
+    vector<int> vals(nset);
+    for (size_t i = 0; i < nset; i++) {
+        where[i] = getRandomIndex<N>(dims);
+        vals[i] = 1 + rand() % max(density, 1);
+    }
+
+    MultiDim<int, N> rnd(dims);
+    Timer t;
+    for (size_t i = 0; i < nset; i++) {
+        rnd.set(vals[i], where[i]);
+    }
+    report("set rand", name, density, nset, t.ms(), rnd.counters());
+
+    MultiDim<int, N> seq(dims);
+    size_t i = 0;
+    t = Timer();
+    for (auto idx : mdrange<N>(dims)) {
+        seq.set((rand() % 100 < density) ? vals[i++ % nset] : 0, idx);
+    }
+    report("set seq", name, density, cells, t.ms(), seq.counters());
+
+    size_t nget = cells * scale;
+    vector<array<int, N> > probe(nget);
+    for (auto& idx : probe) {
+        idx = getRandomIndex<N>(dims);
+    }
+    rnd.resetCounters();
+    long acc = 0;
+    t = Timer();
+    for (auto& idx : probe) {
+        acc += rnd.get(idx);
+    }
+    report("get rand", name, density, nget, t.ms(), rnd.counters());
+
+    rnd.resetCounters();
+    t = Timer();
+    for (auto idx : mdrange<N>(dims)) {
+        acc += rnd.get(idx);
+    }
+    report("get seq", name, density, cells, t.ms(), rnd.counters());
+    sink = acc;
+
+    MultiDim<int, N> other(generateIntNDimArr<N>(dims, density));
+    size_t nnz = rnd.stats().count + other.stats().count;
+    t = Timer();
+    MultiDim<int, N> sum = rnd + other;
+    report("add", name, density, nnz, t.ms());
+    t = Timer();
+    MultiDim<int, N> diff = rnd - other;
+    report("sub", name, density, nnz, t.ms());
+    t = Timer();
+    MultiDim<int, N> scaled = rnd * 3;
+    report("mul 3", name, density, nnz / 2, t.ms());
+    t = Timer();
+    MultiDim<int, N> opered = rnd.oper(foo7());
+    report("oper", name, density, nnz / 2, t.ms());
+    sink = sum.get(probe[0]) + diff.get(probe[0]) + scaled.get(probe[0])
+            + opered.get(probe[0]);
+
+    rnd.resetCounters();
+    t = Timer();
+    rnd.dump("_bench.bin");
+    report("dump", name, density, nnz / 2, t.ms(), rnd.counters());
+    int err;
+    t = Timer();
+    SparseDim<int, N> loaded = SparseDim<int, N>::load("_bench.bin", err);
+    report("load", name, density, nnz / 2, t.ms());
+    sink = loaded.get(probe[0]);
+    remove("_bench.bin");
+}
+
+void benchMatrix(int n, int density) {
+    string name = to_string(n) + "x" + to_string(n);
+    SparseMatrix<int> a = generateIntMatrix(n, n, density);
+    SparseMatrix<int> b = generateIntMatrix(n, n, density);
+    vector<int> x(n);
+    for (int& v : x) {
+        v = rand() % 10;
+    }
+    size_t nnz = a.stats().count;
+    Timer t;
+    vector<int> y;
+    for (int r = 0; r < scale * 10; r++) {
+        y = a * x;
+    }
+    report("spmv", name, density, nnz * scale * 10, t.ms());
+    t = Timer();
+    SparseMatrix<int> c = a * b;
+    report("spgemm", name, density, nnz, t.ms());
+    sink = y[0] + c.get(0, 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        scale = max(atoi(argv[1]), 1);
+    }
+    srand(7);
+    for (int density : { 1, 5, 20, 50 }) {
+        benchND<2>( { { 400, 500 } }, density);
+        benchND<3>( { { 8, 150, 160 } }, density);
+        benchND<4>( { { 4, 6, 80, 90 } }, density);
+        benchND<5>( { { 2, 3, 4, 60, 70 } }, density);
+        benchMatrix(400, density);
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * This file is part of the MultiDimSparseArray library
+ *
+ * @license  BSD-3
+ * @author   Abhilekh Agarwal
+ */
+
+
+#ifndef __SPARSEMATRIX_GENERATORS_H__
+#define __SPARSEMATRIX_GENERATORS_H__
+
+#include <array>
+#include <cstdlib>
+#include "src/multiDimIter.tpp"
+#include "src/sparseDim.tpp"
+#include "src/sparseMatrix.tpp"
+
+// Random data shared by testdsutil.cpp and benchdsutil.cpp. About density
+// percent of cells get a value in [1, density].
+
+inline SparseMatrix<int> generateIntMatrix(int rows, int columns, int density = 20) {
+    SparseMatrix<int> matrix(rows, columns);
+
+    for (int i =0; i <rows; i++) {
+        for (int j = 0; j< columns; j++) {
+            auto val = rand() % 101;
+            if (val > density)
+                val = 0;
+            matrix.set(val, i, j);
+        }
+    }
+    return matrix;
+}
+
+template<int N>
+SparseDim<int, N> generateIntNDimArr(std::array<int, N> arr,
+        int density = 20) {
+    SparseDim<int, N> sd(arr);
+    for (std::array<int, N> _arr : mdrange<N>(arr)) {
+        int val = rand() % 101;
+        if (val > density)
+            val = 0;
+        sd.set(val, _arr);
+    }
+    return sd;
+}
+
+template<int N>
+std::array<int, N> getRandomIndex(std::array<int, N> sz) {
+    for (int i =0; i<N; i++) {
+        sz[i] = (sz[i] != 1) ? rand() % sz[i] : 0;
+    }
+    return sz;
+}
+
+#endif
@@ -0,0 +1,245 @@
+/**
+ * This file is part of the MultiDimSparseArray library
+ *
+ * @license  BSD-3
+ * @author   Abhilekh Agarwal
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "exception.h"
+#include "multiDimIter.tpp"
+#include "sparseDim.tpp"
+
+/*
+ Read optimised, compact copy of a SparseDim. SparseDim keeps three vectors
+ per virtual slice, empty ones included, and each non empty slice has its
+ own allocations, which for a big, very sparse array costs more than the
+ data. Here all slices share single arrays:
+
+ _sliceid : ids of non empty slices, sorted. Empty slices take no space.
+ _nzoff   : where each stored slice starts in cols/vals (+ sentinel)
+ _rowptr  : rows + 1 offsets per stored slice, relative to slice start
+ _cols    : column of every stored value
+ _vals    : values, or _codes into _dict when dictionary encoded
+
+ IndexT is the width of _rowptr and _cols. It is a template parameter so
+ the choice is made at compile time, IndexFor<ROWS, COLS>::type picks
+ the narrowest type which can hold a column and an offset inside a slice.
+ Sensor like data repeats a lot, so values can be dictionary encoded into
+ 16 bit codes (when there are no more than 65536 distinct values and T
+ can be hashed, otherwise values are stored raw).
+ */
+
+template<unsigned long ROWS, unsigned long COLS>
+struct IndexFor {
+    typedef typename std::conditional<
+            (ROWS * COLS <= std::numeric_limits<uint16_t>::max()), uint16_t,
+            uint32_t>::type type;
+};
+
+// Whether std::hash<T> is usable, dictionary encoding needs it.
+template<typename T, typename = void>
+struct IsHashable: std::false_type {
+};
+
+template<typename T>
+struct IsHashable<T,
+        decltype(void(std::hash<T>()(std::declval<const T&>())))> :
+        std::true_type {
+};
+
+template<typename T, unsigned N = 2, typename IndexT = uint32_t>
+class CompactDim {
+public:
+
+    // === CREATION ==============================================
+    explicit CompactDim(const SparseDim<T, N> &sd, bool dictionary = false) :
+            _dims_sz(sd._dims_sz), _defval(sd._defval) {
+        static_assert(std::is_unsigned<IndexT>::value,
+                "Index type has to be unsigned");
+        sd.checkCompacted();
+        uint64_t nrows = _dims_sz[N - 2];
+        uint64_t ncols = _dims_sz[N - 1];
+        if (nrows * ncols > std::numeric_limits<IndexT>::max()) {
+            throw InvalidDimensionsException(
+                    "Index type too narrow for rows x cols of a slice.");
+        }
+
+        size_t nnz = 0, nslice = 0;
+        for (auto& vallst : sd.vallst_lst) {
+            nnz += vallst.size();
+            nslice += !vallst.empty();
+        }
+        _sliceid.reserve(nslice);
+        _nzoff.reserve(nslice + 1);
+        _rowptr.reserve(nslice * (nrows + 1));
+        _cols.reserve(nnz);
+
+        // Values of stored slices in order are all values in order, so
+        // codes can be built apart from the index arrays.
+        bool encode = dictionary && encodeValues(sd, nnz, IsHashable<T>());
+        if (!encode) {
+            _vals.reserve(nnz);
+        }
+
+        for (size_t _v = 0; _v < sd._virdimsz; _v++) {
+            auto& vallst = sd.vallst_lst[_v];
+            if (vallst.empty()) {
+                continue;
+            }
+            _sliceid.push_back(_v);
+            _nzoff.push_back(_cols.size());
+            for (int r : sd.rowlst_lst[_v]) {
+                _rowptr.push_back(r);
+            }
+            for (int c : sd.collst_lst[_v]) {
+                _cols.push_back(c);
+            }
+            if (!encode) {
+                _vals.insert(_vals.end(), vallst.begin(), vallst.end());
+            }
+        }
+        _nzoff.push_back(_cols.size());
+    }
+
+    // === VALUES ==============================================
+
+    T get(const std::array<int, N> &atloc) const {
+        size_t _v = virtualIndex<N>(_dims_sz, atloc);
+        auto it = std::lower_bound(_sliceid.begin(), _sliceid.end(), _v);
+        if (it == _sliceid.end() || *it != _v) {
+            return _defval;
+        }
+        size_t s = it - _sliceid.begin();
+        const IndexT *rowlst = &_rowptr[s * (_dims_sz[N - 2] + 1)];
+        const IndexT *collst = &_cols[_nzoff[s]];
+        int row = atloc[N - 2];
+        IndexT col = atloc[N - 1];
+        const IndexT *end = collst + rowlst[row + 1];
+        const IndexT *pos = std::lower_bound(collst + rowlst[row], end, col);
+        if (pos != end && *pos == col) {
+            return value(_nzoff[s] + (pos - collst));
+        }
+        return _defval;
+    }
+
+    inline int getdimensions() const {
+        return N;
+    }
+
+    inline unsigned getdimensionsSize(unsigned d) const {
+        return (d < N) ? _dims_sz[d] : 0;
+    }
+
+    inline size_t nnz() const {
+        return _cols.size();
+    }
+
+    inline bool dictionaryEncoded() const {
+        return !_dict.empty();
+    }
+
+    // Bytes held by the arrays.
+    size_t memoryUsage() const {
+        return _sliceid.capacity() * sizeof(uint64_t)
+                + _nzoff.capacity() * sizeof(uint64_t)
+                + (_rowptr.capacity() + _cols.capacity()) * sizeof(IndexT)
+                + (_vals.capacity() + _dict.capacity()) * sizeof(T)
+                + _codes.capacity() * sizeof(uint16_t);
+    }
+
+    // Calls op(coord, value) for each stored cell, in index order.
+    template<typename NzOpType>
+    void forEachNonzero(NzOpType op) const {
+        int nrows = _dims_sz[N - 2];
+        for (size_t s = 0; s < _sliceid.size(); s++) {
+            std::array<int, N> coord = virtualCoord<N>(_dims_sz, _sliceid[s]);
+            const IndexT *rowlst = &_rowptr[s * (nrows + 1)];
+            size_t base = _nzoff[s];
+            for (int row = 0; row < nrows; row++) {
+                coord[N - 2] = row;
+                for (size_t pos = base + rowlst[row]; pos < base + rowlst[row + 1];
+                        pos++) {
+                    coord[N - 1] = _cols[pos];
+                    op(static_cast<const std::array<int, N>&>(coord),
+                            value(pos));
+                }
+            }
+        }
+    }
+
+    // Back to a regular writable array.
+    SparseDim<T, N> toSparseDim() const {
+        SparseDim<T, N> sd(_dims_sz, _defval);
+        int nrows = _dims_sz[N - 2];
+        for (size_t s = 0; s < _sliceid.size(); s++) {
+            size_t _v = _sliceid[s];
+            auto rowlst = _rowptr.begin() + s * (nrows + 1);
+            sd.rowlst_lst[_v].assign(rowlst, rowlst + nrows + 1);
+            sd.collst_lst[_v].assign(_cols.begin() + _nzoff[s],
+                    _cols.begin() + _nzoff[s + 1]);
+            auto& vallst = sd.vallst_lst[_v];
+            vallst.clear();
+            vallst.reserve(_nzoff[s + 1] - _nzoff[s]);
+            for (size_t pos = _nzoff[s]; pos < _nzoff[s + 1]; pos++) {
+                vallst.push_back(value(pos));
+            }
+        }
+        return sd;
+    }
+
+private:
+    std::array<int, N> _dims_sz;
+    T _defval;
+    std::vector<uint64_t> _sliceid;
+    std::vector<uint64_t> _nzoff;
+    std::vector<IndexT> _rowptr;
+    std::vector<IndexT> _cols;
+    std::vector<T> _vals;
+    std::vector<T> _dict;
+    std::vector<uint16_t> _codes;
+
+    // Fills _dict and _codes, false (and nothing kept) when there are more
+    // distinct values than 16 bit codes.
+    bool encodeValues(const SparseDim<T, N> &sd, size_t nnz, std::true_type) {
+        std::unordered_map<T, uint16_t> codes;
+        _codes.reserve(nnz);
+        for (auto& vallst : sd.vallst_lst) {
+            for (const T &val : vallst) {
+                auto it = codes.find(val);
+                if (it == codes.end()) {
+                    if (codes.size() > std::numeric_limits<uint16_t>::max()) {
+                        // too many values, store raw
+                        std::vector<T>().swap(_dict);
+                        std::vector<uint16_t>().swap(_codes);
+                        return false;
+                    }
+                    uint16_t code = codes.size();
+                    it = codes.insert( { val, code }).first;
+                    _dict.push_back(val);
+                }
+                _codes.push_back(it->second);
+            }
+        }
+        return true;
+    }
+
+    // Values which cannot be hashed are kept raw.
+    bool encodeValues(const SparseDim<T, N> &, size_t, std::false_type) {
+        return false;
+    }
+
+    inline T value(size_t pos) const {
+        return _dict.empty() ? _vals[pos] : _dict[_codes[pos]];
+    }
+};
@@ -0,0 +1,675 @@
+/**
+ * This file is part of the MultiDimSparseArray library
+ *
+ * @license  BSD-3
+ * @author   Abhilekh Agarwal
+ */
+
+
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "exception.h"
+#include "mappedFormat.h"
+#include "multiDim.tpp"
+
+/*
+ Array which persists itself as it is changed ("dump on the go"). Two files
+ are kept next to each other:
+
+ path.jrnl : every set() is appended as (virdim, row, col, val, checksum)
+             record. Records are buffered and written in batches.
+ path.ckpt : checkpoint segments. checkpoint() appends only the virtual
+             slices changed since last checkpoint followed by a commit mark,
+             then empties the journal. Older copies of a slice are dead
+             bytes; when they outweigh live ones the file is rewritten.
+
+ Every journal record, slice and commit mark carries a checksum of its
+ bytes. Recovery reads committed segments (a later copy of a slice wins)
+ and replays the journal on top, both stop at the first record which is
+ short, fails its checksum or does not fit the array. That record and
+ everything after it is dropped, so a torn or zero filled tail left by a
+ crash is never applied. Replaying is idempotent as records hold absolute
+ values, so a crash between checkpoint and journal truncation is harmless.
+ So write I/O follows number of changes and not size of array.
+
+ Only set() goes to the journal, so the array is exposed read only through
+ data(); bulk changes should be done on a MultiDim and stored with dump.
+ */
+
+enum JournalSync {
+    SYNC_NONE,       // never fsync, leave it to OS
+    SYNC_CHECKPOINT, // fsync both files at checkpoint
+    SYNC_ALWAYS      // also fsync journal after every batch
+};
+
+template<typename T, unsigned N = 2>
+class JournaledDim: private MultiDim<T, N> {
+public:
+
+    // === CREATION ==============================================
+    // Starts a new store at path, existing files are truncated.
+    JournaledDim(const std::array<int, N> &dims_sz, const std::string &path,
+            T defval = T(), JournalSync sync = SYNC_CHECKPOINT) :
+            MultiDim<T, N>(dims_sz, defval), _path(path), _sync(sync) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                "Journal needs trivially copyable values");
+        init();
+        _ckptfd = openFile(ckptPath(), O_TRUNC);
+        _jrnlfd = openFile(jrnlPath(), O_TRUNC);
+        writeHeader(_ckptfd, CKPT_MAGIC);
+        writeHeader(_jrnlfd, JRNL_MAGIC);
+        _ckptbytes = headerSize();
+        syncFile(_ckptfd);
+        syncFile(_jrnlfd);
+        syncDir();
+    }
+
+    /*
+     Opens store at path and rebuilds array from checkpoint and journal.
+     errcode: 1 cannot open checkpoint, 3 not a checkpoint file, 5 type or
+     dimension mismatch. On error a 1x..x1 store without files is returned,
+     writing to it throws.
+     */
+    static JournaledDim<T, N> recover(const std::string &path, int &errcode,
+            JournalSync sync = SYNC_CHECKPOINT) {
+        errcode = 0;
+        std::array<int, N> dims;
+        T defval;
+        std::ifstream fin((path + ".ckpt").c_str(),
+                std::ios::in | std::ios::binary);
+        if (!fin) {
+            errcode = 1;
+        } else {
+            errcode = readHeader(fin, CKPT_MAGIC, dims, defval);
+        }
+        if (errcode > 0) {
+            std::cout << "error load" << errcode << std::endl;
+            dims.fill(1);
+            return JournaledDim<T, N>(dims, T(), path, sync);
+        }
+        JournaledDim<T, N> jd(dims, defval, path, sync);
+        off_t valid = jd.readCheckpoint(fin);
+        fin.close();
+        jd._ckptfd = jd.openFile(jd.ckptPath(), 0);
+        if (ftruncate(jd._ckptfd, valid) != 0) {
+            throw InvalidStateException("Cannot truncate checkpoint.");
+        }
+        jd._ckptbytes = valid;
+        jd.replayJournal();
+        return jd;
+    }
+
+    JournaledDim(JournaledDim<T, N> && jd) :
+            MultiDim<T, N>(std::move(jd)) {
+        _path = jd._path;
+        _sync = jd._sync;
+        _ckptfd = jd._ckptfd;
+        _jrnlfd = jd._jrnlfd;
+        _ckptbytes = jd._ckptbytes;
+        _batch = jd._batch;
+        _slack = jd._slack;
+        _pending = std::move(jd._pending);
+        _npending = jd._npending;
+        _dirty = std::move(jd._dirty);
+        _dirtylst = std::move(jd._dirtylst);
+        jd._ckptfd = -1;
+        jd._jrnlfd = -1;
+    }
+
+    JournaledDim(const JournaledDim<T, N> &) = delete;
+    JournaledDim<T, N> & operator =(const JournaledDim<T, N> &) = delete;
+
+    ~JournaledDim() {
+        if (_jrnlfd >= 0) {
+            try {
+                flush();
+            } catch (const InvalidStateException &) {
+                // Nothing left to report to, records are lost.
+            }
+            ::close(_jrnlfd);
+        }
+        if (_ckptfd >= 0) {
+            ::close(_ckptfd);
+        }
+    }
+
+    // === VALUES ==============================================
+    using MultiDim<T, N>::get;
+    using MultiDim<T, N>::getdimensions;
+    using MultiDim<T, N>::getdimensionsSize;
+    using MultiDim<T, N>::loglvl;
+    using MultiDim<T, N>::enableWriteBuffer;
+    using MultiDim<T, N>::pendingWrites;
+    using MultiDim<T, N>::counters;
+    using MultiDim<T, N>::resetCounters;
+
+    void set(const T &val, const std::array<int, N> &atloc) {
+        if (this->printallowed)
+            std::cout << __func__ << __LINE__ << "val" << val << std::endl;
+        if (_jrnlfd < 0) {
+            // Store from a failed recover (or moved from), change would
+            // never reach disk.
+            throw InvalidStateException("Store has no journal.");
+        }
+        size_t _v = this->validateGetVirtualDim(atloc);
+        this->_set(val, atloc, _v);
+
+        JournalRecord rec;
+        std::memset(&rec, 0, sizeof(rec));
+        rec.v = _v;
+        rec.row = atloc[N - 2];
+        rec.col = atloc[N - 1];
+        rec.val = val;
+        rec.sum = checksum(reinterpret_cast<const char*>(&rec), sizeof(rec));
+        const char *p = reinterpret_cast<const char*>(&rec);
+        _pending.insert(_pending.end(), p, p + sizeof(rec));
+        _npending++;
+        if (!_dirty[_v]) {
+            _dirty[_v] = true;
+            _dirtylst.push_back(_v);
+        }
+        if (_npending >= _batch) {
+            flush();
+        }
+    }
+
+    // Read only access to everything else MultiDim offers.
+    const MultiDim<T, N> & data() const {
+        return *this;
+    }
+
+    // === PERSISTENCE ==============================================
+
+    // Number of set() records written to journal in one write call.
+    void setBatchSize(size_t records) {
+        _batch = std::max<size_t>(records, 1);
+        if (_npending >= _batch) {
+            flush();
+        }
+    }
+
+    // Checkpoint file is rewritten when it is larger than twice the live
+    // data plus this many bytes.
+    void setRewriteSlack(size_t bytes) {
+        _slack = bytes;
+    }
+
+    inline size_t dirtySlices() const {
+        return _dirtylst.size();
+    }
+
+    // Writes buffered journal records.
+    void flush() {
+        if (!_npending) {
+            return;
+        }
+        if (_jrnlfd < 0) {
+            throw InvalidStateException("Store has no journal.");
+        }
+        writeAll(_jrnlfd, _pending.data(), _pending.size());
+        _pending.clear();
+        _npending = 0;
+        if (_sync == SYNC_ALWAYS) {
+            syncFile(_jrnlfd);
+        }
+    }
+
+    // Stores changed slices and empties journal.
+    void checkpoint() {
+        if (this->printallowed)
+            std::cout << __func__ << __LINE__ << ":" << _dirtylst.size()
+                    << std::endl;
+        flush();
+        this->compact();
+        if (_dirtylst.empty()) {
+            return;
+        }
+        size_t live = headerSize() + COMMIT_BYTES;
+        for (size_t _v : patch::xrange(this->_virdimsz)) {
+            if (!this->vallst_lst[_v].empty()) {
+                live += sliceBytes(_v);
+            }
+        }
+        if (_ckptbytes > 2 * live + _slack) {
+            rewriteCheckpoint();
+        } else {
+            std::vector<char> buf;
+            for (size_t _v : _dirtylst) {
+                appendSlice(buf, _v);
+            }
+            appendCommit(buf, _dirtylst.size());
+            writeAll(_ckptfd, buf.data(), buf.size());
+            _ckptbytes += buf.size();
+            syncFile(_ckptfd);
+        }
+        // Checkpoint has all changes now, journal can start over.
+        if (ftruncate(_jrnlfd, headerSize()) != 0) {
+            throw InvalidStateException("Cannot truncate journal.");
+        }
+        syncFile(_jrnlfd);
+        for (size_t _v : _dirtylst) {
+            _dirty[_v] = false;
+        }
+        _dirtylst.clear();
+    }
+
+private:
+    struct JournalHeader {
+        char magic[8];
+        uint32_t endian;
+        uint32_t version;
+        uint32_t valsize;
+        uint32_t ndims;
+    };
+
+    // Sum is taken over the whole record (padding is zeroed) with sum = 0.
+    struct JournalRecord {
+        uint64_t v;
+        int32_t row, col;
+        T val;
+        uint32_t sum;
+    };
+
+    static const uint32_t SLICE_TAG = 0x53; // 'S'
+    static const uint32_t COMMIT_TAG = 0x43; // 'C'
+    static const uint32_t FORMAT_VERSION = 2;
+    static const size_t COMMIT_BYTES = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    static const size_t DEFAULT_BATCH = 4096;
+    static const size_t REWRITE_SLACK = 1 << 20;
+    static const char CKPT_MAGIC[8];
+    static const char JRNL_MAGIC[8];
+
+    std::string _path;
+    JournalSync _sync;
+    int _ckptfd, _jrnlfd;
+    size_t _ckptbytes;
+    size_t _batch;
+    size_t _slack;
+    std::vector<char> _pending;
+    size_t _npending;
+    std::vector<bool> _dirty;
+    std::vector<size_t> _dirtylst;
+
+    // Used by recover, files are opened afterwards.
+    JournaledDim(const std::array<int, N> &dims_sz, T defval,
+            const std::string &path, JournalSync sync) :
+            MultiDim<T, N>(dims_sz, defval), _path(path), _sync(sync) {
+        init();
+    }
+
+    void init() {
+        _ckptfd = -1;
+        _jrnlfd = -1;
+        _ckptbytes = 0;
+        _batch = DEFAULT_BATCH;
+        _slack = REWRITE_SLACK;
+        _npending = 0;
+        _dirty.assign(this->_virdimsz, false);
+    }
+
+    std::string ckptPath() const {
+        return _path + ".ckpt";
+    }
+
+    std::string jrnlPath() const {
+        return _path + ".jrnl";
+    }
+
+    int openFile(const std::string &path, int flags) const {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | flags,
+                0644);
+        if (fd < 0) {
+            throw InvalidStateException("Cannot open " + path);
+        }
+        return fd;
+    }
+
+    void syncFile(int fd) const {
+        if (_sync != SYNC_NONE) {
+            fsync(fd);
+        }
+    }
+
+    // Makes new names in the directory of the store durable, a renamed
+    // checkpoint is not on disk before this.
+    void syncDir() const {
+        if (_sync == SYNC_NONE) {
+            return;
+        }
+        size_t slash = _path.rfind('/');
+        std::string dir = ".";
+        if (slash != std::string::npos) {
+            dir = slash ? _path.substr(0, slash) : "/";
+        }
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            throw InvalidStateException("Cannot open " + dir);
+        }
+        int rc = fsync(fd);
+        ::close(fd);
+        if (rc != 0) {
+            throw InvalidStateException("Cannot sync " + dir);
+        }
+    }
+
+    void writeAll(int fd, const char *buf, size_t len) const {
+        MDSPARSE_COUNT(this->_counters, byteswritten, len);
+        while (len > 0) {
+            ssize_t n = ::write(fd, buf, len);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw InvalidStateException("Journal write failed.");
+            }
+            buf += n;
+            len -= n;
+        }
+    }
+
+    static size_t headerSize() {
+        return sizeof(JournalHeader) + N * sizeof(int32_t) + sizeof(T);
+    }
+
+    void writeHeader(int fd, const char *magic) const {
+        JournalHeader h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, magic, sizeof(h.magic));
+        h.endian = MAPPED_ENDIAN;
+        h.version = FORMAT_VERSION;
+        h.valsize = sizeof(T);
+        h.ndims = N;
+        std::vector<char> buf;
+        append(buf, h);
+        for (int d : this->_dims_sz) {
+            append(buf, (int32_t) d);
+        }
+        append(buf, this->_defval);
+        writeAll(fd, buf.data(), buf.size());
+    }
+
+    static int readHeader(std::ifstream &fin, const char *magic,
+            std::array<int, N> &dims, T &defval) {
+        JournalHeader h;
+        if (!fin.read(reinterpret_cast<char*>(&h), sizeof(h))
+                || std::memcmp(h.magic, magic, sizeof(h.magic)) != 0
+                || h.endian != MAPPED_ENDIAN || h.version != FORMAT_VERSION) {
+            return 3;
+        }
+        if (h.valsize != sizeof(T) || h.ndims != N) {
+            return 5;
+        }
+        for (int &d : dims) {
+            int32_t d32 = 0;
+            fin.read(reinterpret_cast<char*>(&d32), sizeof(d32));
+            d = d32;
+        }
+        fin.read(reinterpret_cast<char*>(&defval), sizeof(T));
+        for (int d : dims) {
+            if (d < 1) {
+                return 5;
+            }
+        }
+        return fin ? 0 : 3;
+    }
+
+    // FNV-1a, continued from h for data read in pieces. Never 0 for a
+    // record of zeros, so a zero filled tail does not pass.
+    static uint32_t checksum(const char *p, size_t len,
+            uint32_t h = 2166136261u) {
+        for (size_t i = 0; i < len; i++) {
+            h ^= (unsigned char) p[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    template<typename T1>
+    static uint32_t checksum(const std::vector<T1> &v, uint32_t h) {
+        return checksum(reinterpret_cast<const char*>(v.data()),
+                v.size() * sizeof(T1), h);
+    }
+
+    // Appends checksum of buf from start on.
+    static void appendSum(std::vector<char> &buf, size_t start) {
+        append(buf, checksum(buf.data() + start, buf.size() - start));
+    }
+
+    template<typename T1>
+    static void append(std::vector<char> &buf, const T1 &v) {
+        const char *p = reinterpret_cast<const char*>(&v);
+        buf.insert(buf.end(), p, p + sizeof(T1));
+    }
+
+    template<typename T1>
+    static void append(std::vector<char> &buf, const std::vector<T1> &v) {
+        const char *p = reinterpret_cast<const char*>(v.data());
+        buf.insert(buf.end(), p, p + v.size() * sizeof(T1));
+    }
+
+    size_t sliceBytes(size_t _v) const {
+        size_t nnz = this->vallst_lst[_v].size();
+        size_t rows = nnz ? this->_dims_sz[N - 2] + 1 : 0;
+        return 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t)
+                + rows * sizeof(int32_t) + nnz * (sizeof(int32_t) + sizeof(T));
+    }
+
+    // Slice record: tag, virdim, nnz, then rows/cols/vals when nnz > 0,
+    // then checksum.
+    void appendSlice(std::vector<char> &buf, size_t _v) const {
+        uint64_t nnz = this->vallst_lst[_v].size();
+        uint32_t tag = SLICE_TAG;
+        size_t start = buf.size();
+        append(buf, tag);
+        append(buf, (uint64_t) _v);
+        append(buf, nnz);
+        if (nnz) {
+            append(buf, this->rowlst_lst[_v]);
+            append(buf, this->collst_lst[_v]);
+            append(buf, this->vallst_lst[_v]);
+        }
+        appendSum(buf, start);
+    }
+
+    void appendCommit(std::vector<char> &buf, uint64_t nslices) const {
+        uint32_t tag = COMMIT_TAG;
+        size_t start = buf.size();
+        append(buf, tag);
+        append(buf, nslices);
+        appendSum(buf, start);
+    }
+
+    // Full checkpoint in a new file, renamed over the old one.
+    void rewriteCheckpoint() {
+        std::string tmp = ckptPath() + ".tmp";
+        int fd = openFile(tmp, O_TRUNC);
+        writeHeader(fd, CKPT_MAGIC);
+        std::vector<char> buf;
+        uint64_t nslices = 0;
+        for (size_t _v : patch::xrange(this->_virdimsz)) {
+            if (!this->vallst_lst[_v].empty()) {
+                appendSlice(buf, _v);
+                nslices++;
+            }
+            if (buf.size() > REWRITE_SLACK) {
+                writeAll(fd, buf.data(), buf.size());
+                buf.clear();
+            }
+        }
+        appendCommit(buf, nslices);
+        writeAll(fd, buf.data(), buf.size());
+        syncFile(fd);
+        if (std::rename(tmp.c_str(), ckptPath().c_str()) != 0) {
+            ::close(fd);
+            throw InvalidStateException("Cannot replace checkpoint.");
+        }
+        // Rename must be on disk before checkpoint() truncates journal,
+        // otherwise old checkpoint and empty journal can survive a crash.
+        syncDir();
+        ::close(_ckptfd);
+        _ckptfd = fd;
+        struct stat st;
+        fstat(fd, &st);
+        _ckptbytes = st.st_size;
+    }
+
+    // Applies committed segments, returns size of valid prefix of file.
+    off_t readCheckpoint(std::ifstream &fin) {
+        struct SliceData {
+            size_t v;
+            std::vector<int> rows, cols;
+            std::vector<T> vals;
+        };
+        std::vector<SliceData> segment;
+        off_t valid = fin.tellg();
+        int nrows = this->_dims_sz[N - 2];
+        uint64_t cells = (uint64_t) nrows * this->_dims_sz[N - 1];
+        uint32_t tag, stored;
+        while (fin.read(reinterpret_cast<char*>(&tag), sizeof(tag))) {
+            uint32_t sum = checksum(reinterpret_cast<const char*>(&tag),
+                    sizeof(tag));
+            if (tag == COMMIT_TAG) {
+                uint64_t nslices;
+                if (!fin.read(reinterpret_cast<char*>(&nslices),
+                        sizeof(nslices))
+                        || !fin.read(reinterpret_cast<char*>(&stored),
+                                sizeof(stored))
+                        || stored != checksum(
+                                reinterpret_cast<const char*>(&nslices),
+                                sizeof(nslices), sum)
+                        || nslices != segment.size()) {
+                    break;
+                }
+                for (auto &sl : segment) {
+                    if (sl.vals.empty()) {
+                        sl.rows.clear(); // empty slice has no row list
+                    }
+                    this->rowlst_lst[sl.v].swap(sl.rows);
+                    this->collst_lst[sl.v].swap(sl.cols);
+                    this->vallst_lst[sl.v].swap(sl.vals);
+                }
+                segment.clear();
+                valid = fin.tellg();
+                continue;
+            }
+            uint64_t v, nnz;
+            if (tag != SLICE_TAG
+                    || !fin.read(reinterpret_cast<char*>(&v), sizeof(v))
+                    || !fin.read(reinterpret_cast<char*>(&nnz), sizeof(nnz))
+                    || v >= this->_virdimsz || nnz > cells) {
+                break;
+            }
+            sum = checksum(reinterpret_cast<const char*>(&v), sizeof(v), sum);
+            sum = checksum(reinterpret_cast<const char*>(&nnz), sizeof(nnz),
+                    sum);
+            SliceData sl;
+            sl.v = v;
+            if (nnz) {
+                sl.rows.resize(nrows + 1);
+                sl.cols.resize(nnz);
+                sl.vals.resize(nnz);
+                fin.read(reinterpret_cast<char*>(&sl.rows[0]),
+                        (nrows + 1) * sizeof(int32_t));
+                fin.read(reinterpret_cast<char*>(&sl.cols[0]),
+                        nnz * sizeof(int32_t));
+                fin.read(reinterpret_cast<char*>(&sl.vals[0]), nnz * sizeof(T));
+                sum = checksum(sl.vals, checksum(sl.cols,
+                        checksum(sl.rows, sum)));
+            }
+            if (!fin.read(reinterpret_cast<char*>(&stored), sizeof(stored))
+                    || stored != sum || !validSlice(sl)) {
+                break;
+            }
+            segment.push_back(std::move(sl));
+        }
+        return valid;
+    }
+
+    // Row offsets start at 0, never decrease and end at nnz; columns of a
+    // row are in range and increasing, as lookups binary search them.
+    template<typename Slice>
+    bool validSlice(const Slice &sl) const {
+        if (sl.vals.empty()) {
+            return true;
+        }
+        int nrows = this->_dims_sz[N - 2];
+        int ncols = this->_dims_sz[N - 1];
+        if (sl.rows[0] != 0 || sl.rows[nrows] != (int) sl.vals.size()) {
+            return false;
+        }
+        for (int r = 0; r < nrows; r++) {
+            if (sl.rows[r + 1] < sl.rows[r]) {
+                return false;
+            }
+            for (int p = sl.rows[r]; p < sl.rows[r + 1]; p++) {
+                if (sl.cols[p] < 0 || sl.cols[p] >= ncols
+                        || (p > sl.rows[r] && sl.cols[p] <= sl.cols[p - 1])) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void replayJournal() {
+        std::ifstream fin(jrnlPath().c_str(), std::ios::in | std::ios::binary);
+        std::array<int, N> dims;
+        T defval;
+        off_t valid = headerSize();
+        if (fin && readHeader(fin, JRNL_MAGIC, dims, defval) == 0
+                && dims == this->_dims_sz) {
+            JournalRecord rec;
+            while (fin.read(reinterpret_cast<char*>(&rec), sizeof(rec))) {
+                uint32_t stored = rec.sum;
+                rec.sum = 0;
+                if (stored != checksum(reinterpret_cast<const char*>(&rec),
+                        sizeof(rec)) || rec.v >= this->_virdimsz || rec.row < 0
+                        || rec.row >= this->_dims_sz[N - 2] || rec.col < 0
+                        || rec.col >= this->_dims_sz[N - 1]) {
+                    break;
+                }
+                std::array<int, N> atloc;
+                atloc.fill(0);
+                atloc[N - 2] = rec.row;
+                atloc[N - 1] = rec.col;
+                this->_set(rec.val, atloc, rec.v);
+                if (!_dirty[rec.v]) {
+                    _dirty[rec.v] = true;
+                    _dirtylst.push_back(rec.v);
+                }
+                valid += sizeof(rec);
+            }
+            fin.close();
+            _jrnlfd = openFile(jrnlPath(), 0);
+            // Drop a torn or corrupt tail.
+            if (ftruncate(_jrnlfd, valid) != 0) {
+                throw InvalidStateException("Cannot truncate journal.");
+            }
+        } else {
+            fin.close();
+            _jrnlfd = openFile(jrnlPath(), O_TRUNC);
+            writeHeader(_jrnlfd, JRNL_MAGIC);
+        }
+        syncFile(_jrnlfd);
+    }
+};
+
+template<typename T, unsigned N>
+const char JournaledDim<T, N>::CKPT_MAGIC[8] = { 'M', 'D', 'C', 'K', 'P',
+        'N', 'T', '1' };
+
+template<typename T, unsigned N>
+const char JournaledDim<T, N>::JRNL_MAGIC[8] = { 'M', 'D', 'J', 'R', 'N',
+        'L', '0', '1' };
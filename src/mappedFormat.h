@@ -0,0 +1,68 @@
+/**
+ * This file is part of the MultiDimSparseArray library
+ *
+ * @license  BSD-3
+ * @author   Abhilekh Agarwal
+ */
+
+
+#ifndef __SPARSEMATRIX_MAPPEDFORMAT_H__
+#define __SPARSEMATRIX_MAPPEDFORMAT_H__
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+/*
+ Layout of the file written by SparseDim::dumpMapped and read (mmap'ed) by
+ SparseDimView. Every section starts on a MAPPED_ALIGN boundary so arrays
+ can be used in place.
+
+ header | dims int32[N] | defval T
+ slice table: MappedSlice[virdimsz + 1]
+ rows: int32[rows + 1] for every non empty slice, offsets inside the slice
+ cols: int32[nnz], slices one after other
+ vals: T[nnz], same order as cols
+ */
+
+static const char MAPPED_MAGIC[8] = { 'M', 'D', 'S', 'P', 'A', 'R', 'S', 'E' };
+static const uint32_t MAPPED_ENDIAN = 0x01020304;
+static const uint32_t MAPPED_VERSION = 1;
+static const uint64_t MAPPED_ALIGN = 64;
+static const uint64_t MAPPED_NOROWS = ~uint64_t(0);
+
+struct MappedHeader {
+    char magic[8];
+    uint32_t endian;    // MAPPED_ENDIAN as written by the producer
+    uint32_t version;
+    uint32_t valsize;   // sizeof(T)
+    uint32_t ndims;     // N
+    uint64_t virdimsz;
+    uint64_t nnz;
+    uint64_t dimsoff;   // section offsets from start of file
+    uint64_t defoff;
+    uint64_t sliceoff;
+    uint64_t rowoff;
+    uint64_t coloff;
+    uint64_t valoff;
+    uint64_t filesize;
+};
+
+// One entry per virtual slice, plus a sentinel with total nnz.
+struct MappedSlice {
+    uint64_t nzbegin;   // index of first col/val of the slice
+    uint64_t rowbegin;  // index in rows array, MAPPED_NOROWS if slice empty
+};
+
+inline uint64_t mappedAlign(uint64_t off) {
+    return (off + MAPPED_ALIGN - 1) / MAPPED_ALIGN * MAPPED_ALIGN;
+}
+
+inline void mappedPad(std::ofstream &fout, uint64_t &off) {
+    static const char zeros[MAPPED_ALIGN] = { 0 };
+    uint64_t next = mappedAlign(off);
+    fout.write(zeros, next - off);
+    off = next;
+}
+
+#endif
@@ -15,9 +15,10 @@
 #include <unordered_map>
 #include <vector>
 #include "patch/patch.hpp"
-#include "SparseDim.tpp"
+#include "sparseDim.tpp"
 #include "exception.h"
-#include "MultiDimIter.tpp"
+#include "multiDimIter.tpp"
+#include "parallel.tpp"
 
 template<typename T, unsigned N = 2>
 class MultiDim: public SparseDim<T, N> {
@@ -31,6 +32,30 @@ public:
             SparseDim<T, N>(matrix) {  // Constructor 2
     }
 
+    template<typename CoordIt, typename ValIt>
+    MultiDim(const std::array<int, N> &dims_sz, CoordIt cbegin,
+            CoordIt cend, ValIt vbegin, T defval = T()) :
+            SparseDim<T, N>(dims_sz, cbegin, cend, vbegin, defval) {
+    }
+
+    template<typename CoordIt, typename ValIt, typename CombineType>
+    MultiDim(const std::array<int, N> &dims_sz, CoordIt cbegin,
+            CoordIt cend, ValIt vbegin, T defval, CombineType combine) :
+            SparseDim<T, N>(dims_sz, cbegin, cend, vbegin, defval, combine) {
+    }
+
+    MultiDim(const MultiDim<T, N> & matrix) :
+            SparseDim<T, N>(matrix) {  // copy constructor
+    }
+
+    MultiDim(SparseDim<T, N> && matrix) :
+            SparseDim<T, N>(std::move(matrix)) {  // Constructor 3
+    }
+
+    MultiDim(MultiDim<T, N> && matrix) :
+            SparseDim<T, N>(std::move(matrix)) {  // move constructor
+    }
+
     MultiDim<T, N> & operator =(const MultiDim<T, N> & matrix) {
         this->printallowed = 0;
         if (this->printallowed)
@@ -53,141 +78,154 @@ public:
         return *this;
     }
 
+    MultiDim<T, N> & operator =(MultiDim<T, N> && matrix) {
+        if (&matrix != this) {
+            this->moveFrom(matrix);
+        }
+        return *this;
+    }
+
+    MultiDim<T, N> & operator =(SparseDim<T, N> && matrix) {
+        if (&matrix != this) {
+            this->moveFrom(matrix);
+        }
+        return *this;
+    }
+
 // === OPERATORS ==============================================
+// Operators on a temporary (a + b + c, (a - b) * 2) work in place on it
+// instead of copying it again.
 
-    MultiDim<T, N> operator +(const T &t) {
-        return _oper([&t](T& i) {i+=t;}, false);
+    MultiDim<T, N> operator +(const T &t) const & {
+        return this->_oper([&t](T& i) {i+=t;}, false);
     }
 
-    MultiDim<T, N> operator +(const MultiDim<T, N> &sd) {
-        if (this->printallowed)
-            std::cout << __func__ << __LINE__ << std::endl;
-        if (this->_dims_sz != sd._dims_sz) {
-            throw InvalidDimensionsException(
-                    "Cannot add: matrices dimensions don't match.");
-        }
-        auto defval = this->_defval + sd._defval;
-        MultiDim<T, N> result(*this);
-        result._defval = defval;
-
-        if (sd._defval == T()) {
-            // Now result equlas part 1, and can only change when there is
-            // a val in part b. Another assumption is
-            // b's default value is 0 which makes add/subs as 1st val
-            for (int _v : patch::xrange(this->_virdimsz)) {
-                auto& rowlst = sd.rowlst_lst[_v];
-                auto& collst = sd.collst_lst[_v];
-                auto& vallst = sd.vallst_lst[_v];
-                for (int row : patch::xrange(this->_dims_sz[N - 2])) {
-                    for (int pos = rowlst[row]; pos < rowlst[row + 1]; pos++) {
-                        auto chval = vallst.at(pos);
-                        result._setop(_v, row, collst[pos],
-                                [&chval](T i) {return (i + chval);});
-                    }
-                }
-            }
-        } else {
-            // General case
-            int vgrp = -1;
-            for (auto arr : mdrange<N>(this->_dims_sz)) {
-                if (!arr[N - 2] && !arr[N - 1]) {
-                    vgrp++;
-                }
-                auto oval = this->_get(arr, vgrp);
-                auto nval = oval + sd._get(arr, vgrp);
-                if (nval != oval)
-                    result._set(nval, arr, vgrp);
-            }
-        }
+    MultiDim<T, N> operator +(const T &t) && {
+        this->_apply([&t](T& i) {i+=t;}, false);
+        return std::move(*this);
+    }
+
+    MultiDim<T, N> operator +(const MultiDim<T, N> &sd) const & {
+        MultiDim<T, N> result(this->_dims_sz);
+        this->_merge(sd, Add(), result, "Cannot add");
         return result;
     }
 
-    MultiDim<T, N> operator -(const T &t) const {
-        return _oper([&t](T& i) {i-=t;}, false);
+    MultiDim<T, N> operator +(const MultiDim<T, N> &sd) && {
+        this->_merge(sd, Add(), *this, "Cannot add");
+        return std::move(*this);
     }
 
-    MultiDim<T, N> operator -(const MultiDim<T, N> &sd) {
-        if (this->printallowed)
-            std::cout << __func__ << __LINE__ << std::endl;
-        if (this->_dims_sz != sd._dims_sz) {
-            throw InvalidDimensionsException(
-                    "Cannot sub: matrices dimensions don't match.");
-        }
-        auto defval = this->_defval - sd._defval;
+    MultiDim<T, N> & operator +=(const MultiDim<T, N> &sd) {
+        this->_merge(sd, Add(), *this, "Cannot add");
+        return *this;
+    }
+
+    MultiDim<T, N> operator -(const T &t) const & {
+        return this->_oper([&t](T& i) {i-=t;}, false);
+    }
+
+    MultiDim<T, N> operator -(const T &t) && {
+        this->_apply([&t](T& i) {i-=t;}, false);
+        return std::move(*this);
+    }
+
+    MultiDim<T, N> operator -(const MultiDim<T, N> &sd) const & {
+        MultiDim<T, N> result(this->_dims_sz);
+        this->_merge(sd, Sub(), result, "Cannot sub");
+        return result;
+    }
+
+    MultiDim<T, N> operator -(const MultiDim<T, N> &sd) && {
+        this->_merge(sd, Sub(), *this, "Cannot sub");
+        return std::move(*this);
+    }
+
+    MultiDim<T, N> & operator -=(const MultiDim<T, N> &sd) {
+        this->_merge(sd, Sub(), *this, "Cannot sub");
+        return *this;
+    }
+
+    MultiDim<T, N> operator *(const T &t) const & {
         MultiDim<T, N> result(*this);
-        result._defval = defval;
-        if (sd._defval == T()) {
-            // Now result equals part 1, and can only change when there is
-            // a val in part b. Another assumption is
-            // b's default value is 0 which makes add/subs as 1st val
-            for (int _v : patch::xrange(this->_virdimsz)) {
-                auto& rowlst = sd.rowlst_lst[_v];
-                auto& collst = sd.collst_lst[_v];
-                auto& vallst = sd.vallst_lst[_v];
-                for (int row : patch::xrange(this->_dims_sz[N - 2])) {
-                    for (int pos = rowlst[row]; pos < rowlst[row + 1]; pos++) {
-                        auto chval = vallst.at(pos);
-                        result._setop(_v, row, collst[pos],
-                                [&chval](T i) {return (i - chval);});
-                    }
-                }
-            }
-        } else {
-            // General case
-            int vgrp = -1;
-            for (auto arr : mdrange<N>(this->_dims_sz)) {
-                if (!arr[N - 2] && !arr[N - 1]) {
-                    vgrp++;
-                }
-                auto oval = this->_get(arr, vgrp);
-                auto nval = oval - sd._get(arr, vgrp);
-                if (nval != oval)
-                    result._set(nval, arr, vgrp);
-            }
-        }
+        result._mul(t);
         return result;
     }
 
-    MultiDim<T, N> operator *(const T &t) const {
-        if (t == T() && (this->vallst_lst[0].size() > 0)
-                && (t * this->vallst_lst[0][0] == t)) {
-            // This means either t is some thing like zero or
-            // 1st item is identity element in my domain.
-            // Making idempotent does not make sense.
-            MultiDim<T, N> result(*this);
-            result._defval = this->_defval * t;
-
-            for (auto& vallst : result.vallst_lst)
-                vallst.clear();
-            for (auto& collst : result.collst_lst)
-                collst.clear();
-            for (auto& rowlst : result.rowlst_lst)
-                std::fill(rowlst.begin(), rowlst.end(), 0);
-            return result;
-        } else {
-            // Simple case
-            return this->_oper([&t](T& i) {i*=t;}, false);
-        }
+    MultiDim<T, N> operator *(const T &t) && {
+        this->_mul(t);
+        return std::move(*this);
+    }
+
+    // Element wise product. SparseMatrix does not export it, its * of two
+    // matrices is matrix product.
+    MultiDim<T, N> operator *(const MultiDim<T, N> &sd) const & {
+        MultiDim<T, N> result(this->_dims_sz);
+        this->_merge(sd, Mul(), result, "Cannot mul");
+        return result;
     }
 
-    MultiDim<T, N> operator /(const T &t) const {
+    MultiDim<T, N> operator *(const MultiDim<T, N> &sd) && {
+        this->_merge(sd, Mul(), *this, "Cannot mul");
+        return std::move(*this);
+    }
+
+    MultiDim<T, N> & operator *=(const MultiDim<T, N> &sd) {
+        this->_merge(sd, Mul(), *this, "Cannot mul");
+        return *this;
+    }
+
+    MultiDim<T, N> operator /(const T &t) const & {
         return this->_oper([&t](T& i) {i/=t;}, false);
     }
 
-    MultiDim<T, N> operator %(const T &t) const {
+    MultiDim<T, N> operator /(const T &t) && {
+        this->_apply([&t](T& i) {i/=t;}, false);
+        return std::move(*this);
+    }
+
+    MultiDim<T, N> operator %(const T &t) const & {
         return this->_oper([&t](T& i) {i%=t;}, false);
     }
 
+    MultiDim<T, N> operator %(const T &t) && {
+        this->_apply([&t](T& i) {i%=t;}, false);
+        return std::move(*this);
+    }
+
+    // Element wise minimum / maximum of two arrays.
+    MultiDim<T, N> min(const MultiDim<T, N> &sd) const {
+        MultiDim<T, N> result(this->_dims_sz);
+        this->_merge(sd, Min(), result, "Cannot min");
+        return result;
+    }
+
+    MultiDim<T, N> max(const MultiDim<T, N> &sd) const {
+        MultiDim<T, N> result(this->_dims_sz);
+        this->_merge(sd, Max(), result, "Cannot max");
+        return result;
+    }
+
     template<typename UniOpType>
-    MultiDim<T, N> oper(UniOpType op) const {
+    MultiDim<T, N> oper(UniOpType op) const & {
         return this->_oper(op, true);
     }
 
+    template<typename UniOpType>
+    MultiDim<T, N> oper(UniOpType op) && {
+        this->_apply(op, true);
+        return std::move(*this);
+    }
+
     // === FRIEND FUNCTIONS =========================================
 
     friend std::ostream & operator <<(std::ostream & os,
             const MultiDim<T, N> & sd) {
+        // Stored values are picked up with a cursor walking each row,
+        // instead of searching the row again for every cell.
+        bool staged = sd.pendingWrites() > 0;
         int vgrp = -1;
+        int pos = 0, rowend = 0;
         for (auto arr : mdrange<N>(sd._dims_sz)) {
             if (!arr[N - 1]) {
                 os << "\n";
@@ -203,63 +241,167 @@ public:
             if (arr[N - 1]) {
                 os << " ";
             }
-            os << sd._get(arr, vgrp);
+            if (staged) {
+                os << sd._get(arr, vgrp);
+                continue;
+            }
+            if (!arr[N - 1]) {
+                pos = sd.rowsOf(vgrp)[arr[N - 2]];
+                rowend = sd.rowsOf(vgrp)[arr[N - 2] + 1];
+            }
+            if (pos < rowend && sd.collst_lst[vgrp][pos] == arr[N - 1]) {
+                os << sd.vallst_lst[vgrp][pos++];
+            } else {
+                os << sd._defval;
+            }
         }
         return os;
     }
 
 protected:
     void deepCopy(const MultiDim<T, N> & md) {
+        SparseDim<T, N>::deepCopy(md);
+    }
+
+    /*
+     Cell wise out = op(this, sd). A cell missing from one side takes that
+     side's default value, so every row is a two pointer merge of the two
+     sorted column lists and a slice is rebuilt in one pass, whatever the
+     default values are. out can be this (or sd): a slice is fully read
+     before its rebuilt lists are swapped in, and the old lists are reused
+     as scratch for the next slice.
+     */
+    template<typename BinOpType>
+    void _merge(const MultiDim<T, N> &sd, BinOpType op, MultiDim<T, N> &out,
+            const std::string &what) const {
         if (this->printallowed)
             std::cout << __func__ << __LINE__ << std::endl;
-        this->_virdimsz = md._virdimsz;
-        this->_defval = md._defval;
-        std::copy(std::begin(md._dims_sz), std::end(md._dims_sz),
-                std::begin(this->_dims_sz));
-        this->vallst_lst = std::vector<std::vector<T> >(this->_virdimsz);
-        this->collst_lst = std::vector<std::vector<int> >(this->_virdimsz);
-        this->rowlst_lst = std::vector<std::vector<int> >(this->_virdimsz);
-        for (int i : patch::xrange(this->_virdimsz)) {
-            this->vallst_lst[i] = std::vector<T>(md.vallst_lst[i]);
-            this->vallst_lst[i].reserve(10);
-            this->collst_lst[i] = std::vector<int>(md.collst_lst[i]);
-            this->collst_lst[i].reserve(10);
-            // We make row one size larger in CSR
-            this->rowlst_lst[i] = std::vector<int>(md.rowlst_lst[i]);
+        if (this->_dims_sz != sd._dims_sz
+                || this->_dims_sz != out._dims_sz) {
+            throw InvalidDimensionsException(
+                    what + ": matrices dimensions don't match.");
         }
+        this->checkCompacted();
+        sd.checkCompacted();
+        const T adef = this->_defval;
+        const T bdef = sd._defval;
+        const T defval = op(adef, bdef);
+        int nrows = this->_dims_sz[N - 2];
+        // Scratch lists per worker, slices are merged in parallel.
+        unsigned nworker = parallel::workerCount();
+        std::vector<std::vector<T> > wvals(nworker);
+        std::vector<std::vector<int> > wcols(nworker);
+        std::vector<std::vector<int> > wrows(nworker);
+
+        auto nnz = [this, &sd](size_t _v) {
+            return this->vallst_lst[_v].size() + sd.vallst_lst[_v].size();
+        };
+        parallel::forBalanced(this->_virdimsz, nnz, false,
+                [&](size_t _v, size_t, size_t, unsigned w) {
+                    auto& vals = wvals[w];
+                    auto& cols = wcols[w];
+                    auto& rows = wrows[w];
+                    auto& acol = this->collst_lst[_v];
+                    auto& aval = this->vallst_lst[_v];
+                    auto& bcol = sd.collst_lst[_v];
+                    auto& bval = sd.vallst_lst[_v];
+                    if (aval.empty() && bval.empty()) {
+                        // All cells default on both sides, out slice is
+                        // empty already (fresh result or this).
+                        return;
+                    }
+                    auto& arow = this->rowsOf(_v);
+                    auto& brow = sd.rowsOf(_v);
+                    vals.clear();
+                    cols.clear();
+                    if (vals.capacity() < aval.size() + bval.size()) {
+                        MDSPARSE_COUNT(out._counters, allocations, 2);
+                    }
+                    if (rows.capacity() < (size_t) nrows + 1) {
+                        MDSPARSE_COUNT(out._counters, allocations, 1);
+                    }
+                    vals.reserve(aval.size() + bval.size());
+                    cols.reserve(aval.size() + bval.size());
+                    rows.resize(nrows + 1);
+                    rows[0] = 0;
+                    for (int row : patch::xrange(nrows)) {
+                        int p = arow[row], pend = arow[row + 1];
+                        int q = brow[row], qend = brow[row + 1];
+                        while (p < pend || q < qend) {
+                            int col;
+                            T val;
+                            if (q == qend || (p < pend && acol[p] < bcol[q])) {
+                                col = acol[p];
+                                val = op(aval[p++], bdef);
+                            } else if (p == pend || bcol[q] < acol[p]) {
+                                col = bcol[q];
+                                val = op(adef, bval[q++]);
+                            } else {
+                                col = acol[p];
+                                val = op(aval[p++], bval[q++]);
+                            }
+                            if (val != defval) {
+                                cols.push_back(col);
+                                vals.push_back(val);
+                            }
+                        }
+                        rows[row + 1] = cols.size();
+                    }
+                    out.vallst_lst[_v].swap(vals);
+                    out.collst_lst[_v].swap(cols);
+                    out.rowlst_lst[_v].swap(rows);
+                    out.releaseIfEmpty(_v);
+                });
+        out._defval = defval;
     }
 
-private:
-    template<typename OpType>
-    inline void _setop(int _virtualidx, int row, int col, OpType op) {
-        // No bound check. It will make it slower
-        if (this->printallowed > 1)
-            std::cout << __func__ << __LINE__ << std::endl;
-        int currCol = -1;
-        auto& rowlst = this->rowlst_lst[_virtualidx];
-        auto& collst = this->collst_lst[_virtualidx];
-        int pos;
-        for (pos = rowlst[row]; pos < rowlst[row + 1]; pos++) {
-            currCol = collst[pos];
-
-            if (currCol >= col) {
-                break;
+    inline void _mul(const T &t) {
+        this->compact();
+        if (t == T() && (this->vallst_lst[0].size() > 0)
+                && (t * this->vallst_lst[0][0] == t)) {
+            // This means either t is some thing like zero or
+            // 1st item is identity element in my domain.
+            // Making idempotent does not make sense.
+            this->_defval = this->_defval * t;
+
+            for (size_t _v : patch::xrange(this->_virdimsz)) {
+                this->vallst_lst[_v].clear();
+                this->releaseIfEmpty(_v);
             }
+        } else {
+            // Simple case
+            this->_apply([&t](T& i) {i*=t;}, false);
         }
-        if (currCol != col) {
-            T val = op(T());
-            if (val != this->_defval) {
-                this->insert(_virtualidx, pos, row, col, val);
-            }
+    }
 
-        } else {
-            T val = op(this->vallst_lst[_virtualidx][pos]);
-            if (val == this->_defval) {
-                this->remove(_virtualidx, pos, row);
+private:
+    struct Add {
+        T operator()(const T &a, const T &b) const {
+            return a + b;
+        }
+    };
 
-            } else {
-                this->vallst_lst[_virtualidx][pos] = val;
-            }
+    struct Sub {
+        T operator()(const T &a, const T &b) const {
+            return a - b;
         }
-    }
+    };
+
+    struct Mul {
+        T operator()(const T &a, const T &b) const {
+            return a * b;
+        }
+    };
+
+    struct Min {
+        T operator()(const T &a, const T &b) const {
+            return (b < a) ? b : a;
+        }
+    };
+
+    struct Max {
+        T operator()(const T &a, const T &b) const {
+            return (a < b) ? b : a;
+        }
+    };
 };
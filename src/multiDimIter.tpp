@@ -74,3 +74,36 @@ public:
         return iter;
     }
 };
+
+/*
+ Index of virtual slice (row major over the leading N - 2 coordinates) as
+ used by SparseDim, and the inverse of it. Coordinates are checked against
+ dims.
+ */
+template<unsigned N>
+inline size_t virtualIndex(const std::array<int, N> &dims,
+        const std::array<int, N> &coord) {
+    size_t pv = 0;
+    for (unsigned i = 0; i < N; i++) {
+        if (coord[i] < 0 || coord[i] >= dims[i]) {
+            throw InvalidCoordinatesException("Coordinates out of range.");
+        }
+        if (i + 2 < N) {
+            pv = pv * dims[i] + coord[i];
+        }
+    }
+    return pv;
+}
+
+// Leading coordinates of virtual slice _v, last two are left 0.
+template<unsigned N>
+inline std::array<int, N> virtualCoord(const std::array<int, N> &dims,
+        size_t _v) {
+    std::array<int, N> coord;
+    coord.fill(0);
+    for (int i = N - 3; i >= 0; i--) {
+        coord[i] = _v % dims[i];
+        _v /= dims[i];
+    }
+    return coord;
+}
@@ -0,0 +1,379 @@
+/**
+ * This file is part of the MultiDimSparseArray library
+ *
+ * @license  BSD-3
+ * @author   Abhilekh Agarwal
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ Execution backend for bulk operations. Independent work (virtual slices,
+ rows of a matrix) is cut into tasks which run on a pool of persistent
+ threads. Each worker has its own task queue and takes from its front, an
+ idle worker steals from the back of others, so a few heavy tasks do not
+ leave cores waiting. Calling thread works as worker 0.
+
+ Work below serialLimit() is run on the calling thread so small arrays do
+ not pay for the hand off. A task which itself calls into the pool runs its
+ work inline. Functors given to bulk operations are copied per worker, they
+ must not share mutable state.
+ */
+
+namespace parallel {
+
+// 0 means one thread per hardware thread.
+inline unsigned& configuredThreads() {
+    static unsigned n = 0;
+    return n;
+}
+
+inline size_t& serialLimit() {
+    static size_t limit = 1 << 14;
+    return limit;
+}
+
+inline unsigned threadCount() {
+    unsigned n = configuredThreads();
+    if (!n) {
+        n = std::thread::hardware_concurrency();
+    }
+    return n ? n : 1;
+}
+
+// Takes effect on next bulk operation, must not be called while one runs.
+inline void setThreadCount(unsigned n) {
+    configuredThreads() = n;
+}
+
+// Total weight (usually stored values) below which work is not split.
+inline void setSerialLimit(size_t limit) {
+    serialLimit() = limit;
+}
+
+inline bool& insideWorker() {
+    static thread_local bool inside = false;
+    return inside;
+}
+
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned nthreads) :
+            _stop(false), _gen(0), _busy(0), _remaining(0), _job(nullptr) {
+        nthreads = std::max(nthreads, 1U);
+        for (unsigned w = 0; w < nthreads; w++) {
+            _queues.emplace_back(new TaskQueue());
+        }
+        for (unsigned w = 1; w < nthreads; w++) {
+            _threads.emplace_back(&ThreadPool::worker, this, w);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lk(_mtx);
+            _stop = true;
+        }
+        _wakecv.notify_all();
+        for (auto& t : _threads) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator =(const ThreadPool &) = delete;
+
+    inline unsigned size() const {
+        return _queues.size();
+    }
+
+    // Runs op(task, worker) for task in [0, ntask) and waits for all.
+    template<typename TaskOpType>
+    void run(size_t ntask, TaskOpType op) {
+        if (ntask == 0) {
+            return;
+        }
+        if (size() == 1 || ntask == 1 || insideWorker()) {
+            for (size_t t = 0; t < ntask; t++) {
+                op(t, 0);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> batch(_runmtx);
+        std::function<void(size_t, unsigned)> job = [&op](size_t t,
+                unsigned w) {op(t, w);};
+        _error = nullptr;
+        _remaining = ntask;
+        {
+            std::lock_guard<std::mutex> lk(_mtx);
+            _job = &job;
+            _gen++;
+        }
+        // Job is published before any task can be popped. Neighbouring
+        // tasks go to same worker, they often share data.
+        for (unsigned w = 0; w < size(); w++) {
+            std::lock_guard<std::mutex> lk(_queues[w]->mtx);
+            for (size_t t = ntask * w / size(); t < ntask * (w + 1) / size();
+                    t++) {
+                _queues[w]->tasks.push_back(t);
+            }
+        }
+        _wakecv.notify_all();
+
+        insideWorker() = true;
+        work(0);
+        insideWorker() = false;
+        {
+            std::unique_lock<std::mutex> lk(_mtx);
+            _donecv.wait(lk, [this]() {return _remaining == 0 && _busy == 0;});
+            _job = nullptr;
+        }
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+    }
+
+private:
+    struct TaskQueue {
+        std::mutex mtx;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<TaskQueue> > _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _mtx, _runmtx;
+    std::condition_variable _wakecv, _donecv;
+    bool _stop;
+    unsigned long _gen;
+    unsigned _busy;
+    std::atomic<size_t> _remaining;
+    std::function<void(size_t, unsigned)> *_job;
+    std::exception_ptr _error;
+
+    void worker(unsigned w) {
+        insideWorker() = true;
+        unsigned long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(_mtx);
+                _wakecv.wait(lk, [&]() {return _stop || _gen != seen;});
+                if (_stop) {
+                    return;
+                }
+                seen = _gen;
+                _busy++;
+            }
+            work(w);
+            {
+                std::lock_guard<std::mutex> lk(_mtx);
+                _busy--;
+            }
+            _donecv.notify_all();
+        }
+    }
+
+    void work(unsigned w) {
+        size_t t;
+        while (pop(w, t) || steal(w, t)) {
+            try {
+                (*_job)(t, w);
+            } catch (...) {
+                std::lock_guard<std::mutex> lk(_mtx);
+                if (!_error) {
+                    _error = std::current_exception();
+                }
+            }
+            if (--_remaining == 0) {
+                std::lock_guard<std::mutex> lk(_mtx);
+                _donecv.notify_all();
+            }
+        }
+    }
+
+    bool pop(unsigned w, size_t &t) {
+        std::lock_guard<std::mutex> lk(_queues[w]->mtx);
+        if (_queues[w]->tasks.empty()) {
+            return false;
+        }
+        t = _queues[w]->tasks.front();
+        _queues[w]->tasks.pop_front();
+        return true;
+    }
+
+    bool steal(unsigned w, size_t &t) {
+        for (unsigned i = 1; i < size(); i++) {
+            auto& victim = *_queues[(w + i) % size()];
+            std::lock_guard<std::mutex> lk(victim.mtx);
+            if (!victim.tasks.empty()) {
+                t = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+inline ThreadPool& pool() {
+    static std::mutex mtx;
+    static std::unique_ptr<ThreadPool> instance;
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!instance || instance->size() != threadCount()) {
+        instance.reset(new ThreadPool(threadCount()));
+    }
+    return *instance;
+}
+
+// Per worker buffers of bulk operations are indexed below this.
+inline unsigned workerCount() {
+    return threadCount();
+}
+
+// Number of chunks forChunks will use, so per chunk buffers can be sized.
+// A few chunks per thread leave room for stealing.
+inline size_t chunkCount(size_t begin, size_t end, size_t grain) {
+    if (end <= begin) {
+        return 0;
+    }
+    if (threadCount() < 2) {
+        return 1;
+    }
+    size_t total = end - begin;
+    size_t nchunk = std::min<size_t>(4 * threadCount(),
+            (total + grain - 1) / std::max<size_t>(grain, 1));
+    return std::max<size_t>(nchunk, 1);
+}
+
+// Calls op(lo, hi, chunk, worker) on disjoint chunks covering [begin, end),
+// chunks are in order of index so callers can keep per chunk output, and
+// scratch space can be kept per worker (below workerCount()).
+template<typename RangeOpType>
+void forChunks(size_t begin, size_t end, size_t grain, RangeOpType op) {
+    size_t nchunk = chunkCount(begin, end, grain);
+    if (nchunk == 0) {
+        return;
+    }
+    if (nchunk < 2) {
+        op(begin, end, 0, 0);
+        return;
+    }
+    size_t step = (end - begin + nchunk - 1) / nchunk;
+    pool().run(nchunk, [&](size_t c, unsigned worker) {
+        size_t lo = begin + c * step;
+        size_t hi = std::min(end, lo + step);
+        if (lo < hi) {
+            op(lo, hi, c, worker);
+        }
+    });
+}
+
+/*
+ Runs op(item, from, to, worker) for items [0, n) with tasks of about equal
+ total weight (stored values of a slice, say). When splittable, an item
+ heavier than one task is cut into parts [from, to) of its weight, so a
+ single huge slice is shared by all workers; otherwise from = 0 and
+ to = weight(item).
+ */
+template<typename WeightType, typename ItemOpType>
+void forBalanced(size_t n, WeightType weight, bool splittable,
+        ItemOpType op) {
+    std::vector<size_t> w(n);
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        w[i] = weight(i);
+        total += w[i];
+    }
+    unsigned nthreads = threadCount();
+    if (nthreads < 2 || total < serialLimit() || insideWorker()) {
+        for (size_t i = 0; i < n; i++) {
+            op(i, 0, w[i], 0);
+        }
+        return;
+    }
+
+    struct Task {
+        size_t lo, hi;      // whole items
+        size_t from, to;    // or a part of item lo when hi == lo
+    };
+    size_t target = std::max<size_t>(total / (8 * nthreads), 1);
+    std::vector<Task> tasks;
+    size_t runlo = 0, acc = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (splittable && w[i] > target) {
+            if (runlo < i) {
+                tasks.push_back(Task { runlo, i, 0, 0 });
+            }
+            for (size_t from = 0; from < w[i]; from += target) {
+                tasks.push_back(Task { i, i, from,
+                        std::min(w[i], from + target) });
+            }
+            runlo = i + 1;
+            acc = 0;
+            continue;
+        }
+        acc += w[i] + 1; // + 1, empty items still cost something
+        if (acc >= target) {
+            tasks.push_back(Task { runlo, i + 1, 0, 0 });
+            runlo = i + 1;
+            acc = 0;
+        }
+    }
+    if (runlo < n) {
+        tasks.push_back(Task { runlo, n, 0, 0 });
+    }
+
+    pool().run(tasks.size(), [&](size_t t, unsigned worker) {
+        const Task &task = tasks[t];
+        if (task.hi == task.lo) {
+            op(task.lo, task.from, task.to, worker);
+            return;
+        }
+        for (size_t i = task.lo; i < task.hi; i++) {
+            op(i, 0, w[i], worker);
+        }
+    });
+}
+
+// Sorts chunks on separate threads, then merges neighbouring runs pairwise
+// (each round in parallel) until one run is left. Not stable.
+template<typename RandomIt, typename CompareType>
+void sort(RandomIt first, RandomIt last, CompareType cmp,
+        size_t grain = 1 << 16) {
+    size_t n = last - first;
+    size_t nchunk = chunkCount(0, n, grain);
+    if (nchunk < 2) {
+        std::sort(first, last, cmp);
+        return;
+    }
+    // Same split as forChunks, so run boundaries are multiples of width.
+    size_t width = (n + nchunk - 1) / nchunk;
+    forChunks(0, n, grain, [&](size_t lo, size_t hi, size_t, unsigned) {
+        std::sort(first + lo, first + hi, cmp);
+    });
+    for (; width < n; width *= 2) {
+        size_t npair = (n + 2 * width - 1) / (2 * width);
+        forChunks(0, npair, 1, [&](size_t lo, size_t hi, size_t, unsigned) {
+            for (size_t pr = lo; pr < hi; pr++) {
+                size_t b = pr * 2 * width;
+                size_t m = std::min(n, b + width);
+                size_t e = std::min(n, b + 2 * width);
+                std::inplace_merge(first + b, first + m, first + e, cmp);
+            }
+        });
+    }
+}
+
+}
@@ -0,0 +1,93 @@
+/**
+ * This file is part of the MultiDimSparseArray library
+ *
+ * @license  BSD-3
+ * @author   Abhilekh Agarwal
+ */
+
+
+#ifndef __SPARSEMATRIX_PERFCOUNTERS_H__
+#define __SPARSEMATRIX_PERFCOUNTERS_H__
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ Counters on the hot paths of SparseDim, compiled in only with
+ -DMDSPARSE_COUNTERS. Without it MDSPARSE_COUNT expands to nothing and
+ counters() of an array reports zeros, so release builds pay nothing.
+ Increments are relaxed atomics, concurrent readers can be measured too.
+ */
+
+struct PerfCounters {
+    uint64_t shifts;        // values/cols/row offsets moved by insert, remove
+    uint64_t probes;        // row searches done by get, set
+    uint64_t probelen;      // total length of the rows searched
+    uint64_t allocations;   // list allocations and growths of the array
+    uint64_t byteswritten;  // by dump, dumpMapped and JournaledDim files
+};
+
+#ifdef MDSPARSE_COUNTERS
+
+class PerfCounterSet {
+public:
+    std::atomic<uint64_t> shifts, probes, probelen, allocations, byteswritten;
+
+    PerfCounterSet() {
+        reset();
+    }
+
+    // Counters belong to one array, they are not copied with it.
+    PerfCounterSet(const PerfCounterSet &) :
+            PerfCounterSet() {
+    }
+    PerfCounterSet & operator =(const PerfCounterSet &) {
+        return *this;
+    }
+
+    void reset() {
+        shifts = 0;
+        probes = 0;
+        probelen = 0;
+        allocations = 0;
+        byteswritten = 0;
+    }
+
+    PerfCounters snapshot() const {
+        return PerfCounters { shifts.load(), probes.load(), probelen.load(),
+                allocations.load(), byteswritten.load() };
+    }
+
+    // Counts of an array moved into this one.
+    void absorb(const PerfCounterSet &o) {
+        shifts += o.shifts;
+        probes += o.probes;
+        probelen += o.probelen;
+        allocations += o.allocations;
+        byteswritten += o.byteswritten;
+    }
+};
+
+#define MDSPARSE_COUNT(set, field, n) \
+    ((set).field.fetch_add((n), std::memory_order_relaxed))
+
+#else
+
+class PerfCounterSet {
+public:
+    void reset() {
+    }
+
+    PerfCounters snapshot() const {
+        return PerfCounters { 0, 0, 0, 0, 0 };
+    }
+
+    void absorb(const PerfCounterSet &) {
+    }
+};
+
+#define MDSPARSE_COUNT(set, field, n) ((void) 0)
+
+#endif
+
+#endif
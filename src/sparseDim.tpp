@@ -10,13 +10,21 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 #include "patch/patch.hpp"
 #include "exception.h"
+#include "mappedFormat.h"
 #include "multiDimIter.tpp"
+#include "parallel.tpp"
+#include "perfCounters.h"
 
 #define UNUSED(expr) do { (void)(expr); } while (0)
 
@@ -28,8 +36,17 @@
  and col vector this will also keep insertion and deletion from vector fast.
  */
 
+template<typename T, unsigned N>
+class SparseDimView;
+
+template<typename T, unsigned N, typename IndexT>
+class CompactDim;
+
 template<typename T, unsigned N = 2>
 class SparseDim {
+    friend class SparseDimView<T, N>;
+    template<typename T1, unsigned N1, typename IndexT1>
+    friend class CompactDim;
 public:
 
     // === CREATION ==============================================
@@ -50,15 +67,58 @@ public:
             }
         }
         _defval = defval;
+        _stagelimit = 0;
         vallst_lst = std::vector<std::vector<T> >(_virdimsz);
         collst_lst = std::vector<std::vector<int> >(_virdimsz);
         rowlst_lst = std::vector<std::vector<int> >(_virdimsz);
-        for (int i : patch::xrange(_virdimsz)) {
-            vallst_lst[i].reserve(10);
-            collst_lst[i].reserve(10);
-            // We make row one size larger in CSR
-            rowlst_lst[i] = std::vector<int>(dims_sz[N - 2] + 1, 0);
+        // Lists of a slice are allocated on its first set, an empty slice
+        // has no row list either and only costs the three vector headers.
+        // We make row one size larger in CSR
+        _zerorows.assign(dims_sz[N - 2] + 1, 0);
+        MDSPARSE_COUNT(_counters, allocations, 4);
+    }
+
+    /*
+     Bulk load from coordinate list (COO). coords and vals are parallel
+     ranges. Cells are sorted (in parallel) by virdim, row and col, and CSR
+     lists are built directly with exact sizes. A cell given more than once
+     is folded with combine(acc, next) in input order; without combine the
+     last value wins.
+     */
+    template<typename CoordIt, typename ValIt>
+    SparseDim(const std::array<int, N> &dims_sz, CoordIt cbegin,
+            CoordIt cend, ValIt vbegin, T defval = T()) :
+            SparseDim(dims_sz, cbegin, cend, vbegin, defval, LastWins()) {
+    }
+
+    template<typename CoordIt, typename ValIt, typename CombineType>
+    SparseDim(const std::array<int, N> &dims_sz, CoordIt cbegin,
+            CoordIt cend, ValIt vbegin, T defval, CombineType combine) :
+            SparseDim(dims_sz, defval) {
+        std::vector<CooEntry> entries;
+        for (; cbegin != cend; ++cbegin, ++vbegin) {
+            addEntry(entries, *cbegin, *vbegin);
+        }
+        buildFromCOO(entries, combine);
+    }
+
+    // Same as above from a range of (coordinate, value) pairs.
+    template<typename PairIt, typename CombineType>
+    static SparseDim<T, N> fromEntries(const std::array<int, N> &dims_sz,
+            PairIt begin, PairIt end, T defval, CombineType combine) {
+        SparseDim<T, N> sd(dims_sz, defval);
+        std::vector<CooEntry> entries;
+        for (; begin != end; ++begin) {
+            sd.addEntry(entries, begin->first, begin->second);
         }
+        sd.buildFromCOO(entries, combine);
+        return sd;
+    }
+
+    template<typename PairIt>
+    static SparseDim<T, N> fromEntries(const std::array<int, N> &dims_sz,
+            PairIt begin, PairIt end, T defval = T()) {
+        return fromEntries(dims_sz, begin, end, defval, LastWins());
     }
 
     SparseDim(const SparseDim<T, N> & matrix) { // copy constructor
@@ -79,6 +139,18 @@ public:
         return *this;
     }
 
+    SparseDim(SparseDim<T, N> && matrix) { // move constructor
+        printallowed = 0;
+        moveFrom(matrix);
+    }
+
+    SparseDim<T, N> & operator =(SparseDim<T, N> && matrix) {
+        if (&matrix != this) {
+            this->moveFrom(matrix);
+        }
+        return *this;
+    }
+
     void loglvl(int lvl) {
         printallowed = lvl;
     }
@@ -110,8 +182,373 @@ public:
         return (d < N) ? _dims_sz[d] : 0;
     }
 
+    // === WRITE BUFFER ==============================================
+
+    /*
+     Opt in write mode for random streaming writes. set() puts the value in
+     a hashed buffer instead of shifting CSR lists, get() looks in the buffer
+     first. When buffer holds threshold cells (or compact() is called) it is
+     merged into the CSR slices in one sorted pass. Bulk operations which
+     walk CSR directly (==, dump, array arithmetic) need a compacted array
+     and throw InvalidStateException when writes are pending.
+     */
+    void enableWriteBuffer(size_t threshold = 1 << 16) {
+        _stagelimit = std::max<size_t>(threshold, 1);
+        if (_stage.size() >= _stagelimit) {
+            compact();
+        }
+    }
+
+    void disableWriteBuffer() {
+        compact();
+        _stagelimit = 0;
+    }
+
+    // Bytes held by CSR lists (and write buffer, roughly), see CompactDim
+    // for a smaller read only layout.
+    size_t memoryUsage() const {
+        size_t bytes = 3 * _virdimsz * sizeof(std::vector<int>)
+                + _zerorows.capacity() * sizeof(int);
+        for (size_t _v : patch::xrange(_virdimsz)) {
+            bytes += vallst_lst[_v].capacity() * sizeof(T)
+                    + (collst_lst[_v].capacity() + rowlst_lst[_v].capacity())
+                            * sizeof(int);
+        }
+        return bytes + _stage.size() * (sizeof(StageKey) + sizeof(T)
+                + 2 * sizeof(void*));
+    }
+
+    // Hot path counters, all zero unless built with -DMDSPARSE_COUNTERS.
+    PerfCounters counters() const {
+        return _counters.snapshot();
+    }
+
+    void resetCounters() {
+        _counters.reset();
+    }
+
+    inline size_t pendingWrites() const {
+        return _stage.size();
+    }
+
+    void compact() {
+        if (_stage.empty()) {
+            return;
+        }
+        if (printallowed)
+            std::cout << __func__ << __LINE__ << ":" << _stage.size()
+                    << std::endl;
+        std::vector<std::pair<StageKey, T> > pending(_stage.begin(),
+                _stage.end());
+        _stage.clear();
+        std::sort(pending.begin(), pending.end(),
+                [](const std::pair<StageKey, T> &a,
+                        const std::pair<StageKey, T> &b) {
+                    return a.first < b.first;
+                });
+
+        int nrows = _dims_sz[N - 2];
+        size_t g = 0;
+        while (g < pending.size()) {
+            size_t _v = pending[g].first.v;
+            auto& rowlst = rowsFor(_v);
+            auto& collst = collst_lst[_v];
+            auto& vallst = vallst_lst[_v];
+            // Slice is rebuilt in lists sized for its own staged cells only,
+            // they replace the old ones so capacity stays near nnz.
+            size_t gend = g;
+            while (gend < pending.size() && pending[gend].first.v == _v) {
+                gend++;
+            }
+            std::vector<T> vals;
+            std::vector<int> cols;
+            MDSPARSE_COUNT(_counters, allocations, 2);
+            vals.reserve(vallst.size() + gend - g);
+            cols.reserve(vallst.size() + gend - g);
+            int p = 0;
+            for (int row : patch::xrange(nrows)) {
+                int pend = rowlst[row + 1];
+                if (g == pending.size() || pending[g].first.v != _v
+                        || pending[g].first.row != row) {
+                    // Untouched row, copy as is
+                    cols.insert(cols.end(), collst.begin() + p,
+                            collst.begin() + pend);
+                    vals.insert(vals.end(), vallst.begin() + p,
+                            vallst.begin() + pend);
+                } else {
+                    while (p < pend || (g < pending.size()
+                            && pending[g].first.v == _v
+                            && pending[g].first.row == row)) {
+                        bool staged = g < pending.size()
+                                && pending[g].first.v == _v
+                                && pending[g].first.row == row;
+                        if (staged
+                                && (p == pend
+                                        || pending[g].first.col <= collst[p])) {
+                            if (p < pend && pending[g].first.col == collst[p]) {
+                                p++; // overwritten
+                            }
+                            if (pending[g].second != _defval) {
+                                cols.push_back(pending[g].first.col);
+                                vals.push_back(pending[g].second);
+                            }
+                            g++;
+                        } else {
+                            cols.push_back(collst[p]);
+                            vals.push_back(vallst[p]);
+                            p++;
+                        }
+                    }
+                }
+                p = pend;
+                rowlst[row + 1] = cols.size();
+            }
+            collst.swap(cols);
+            vallst.swap(vals);
+            releaseIfEmpty(_v);
+        }
+    }
+
+    // === NONZERO TRAVERSAL / REDUCTIONS ===========================
+
+    struct Entry {
+        std::array<int, N> coord;
+        T value;
+    };
+
+    // Forward iterator over stored (non default) cells, in index order.
+    class NonzeroIterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Entry* pointer;
+        typedef const Entry& reference;
+
+        NonzeroIterator(const SparseDim<T, N> *sd, size_t _v) :
+                _sd(sd), _v(_v), _row(0), _pos(0) {
+            settle();
+        }
+
+        const Entry& operator*() const {
+            return _cur;
+        }
+        const Entry* operator->() const {
+            return &_cur;
+        }
+        NonzeroIterator& operator++() {
+            _pos++;
+            settle();
+            return *this;
+        }
+        bool operator==(const NonzeroIterator &o) const {
+            return _v == o._v && _pos == o._pos;
+        }
+        bool operator!=(const NonzeroIterator &o) const {
+            return !(*this == o);
+        }
+
+    private:
+        const SparseDim<T, N> *_sd;
+        size_t _v;
+        int _row;
+        size_t _pos;
+        Entry _cur;
+
+        // Moves to the first stored cell at or after (_v, _pos).
+        void settle() {
+            while (_v < _sd->_virdimsz) {
+                auto& vallst = _sd->vallst_lst[_v];
+                if (_pos < vallst.size()) {
+                    auto& rowlst = _sd->rowlst_lst[_v];
+                    if (_pos == 0) {
+                        _cur.coord = virtualCoord<N>(_sd->_dims_sz, _v);
+                        _row = 0;
+                    }
+                    while (rowlst[_row + 1] <= (int) _pos) {
+                        _row++;
+                    }
+                    _cur.coord[N - 2] = _row;
+                    _cur.coord[N - 1] = _sd->collst_lst[_v][_pos];
+                    _cur.value = vallst[_pos];
+                    return;
+                }
+                _v++;
+                _pos = 0;
+            }
+            _pos = 0;
+        }
+    };
+
+    struct NonzeroRange {
+        NonzeroIterator b, e;
+        NonzeroIterator begin() const {
+            return b;
+        }
+        NonzeroIterator end() const {
+            return e;
+        }
+    };
+
+    NonzeroIterator nzbegin() const {
+        checkCompacted();
+        return NonzeroIterator(this, 0);
+    }
+
+    NonzeroIterator nzend() const {
+        return NonzeroIterator(this, _virdimsz);
+    }
+
+    // for (auto& e : sd.nonzeros()) visits e.coord / e.value
+    NonzeroRange nonzeros() const {
+        return NonzeroRange { nzbegin(), nzend() };
+    }
+
+    template<typename NzOpType>
+    void forEachNonzero(NzOpType op) const {
+        for (auto it = nzbegin(); it != nzend(); ++it) {
+            op(it->coord, it->value);
+        }
+    }
+
+    /*
+     Calls op(coord, value) for stored cells in region [start, end) (end is
+     exclusive, as for mdrange). Only slices and rows crossing the region
+     are looked at, and columns are found by binary search.
+     */
+    template<typename NzOpType>
+    void forEachInRegion(const std::array<int, N> &start,
+            const std::array<int, N> &end, NzOpType op) const {
+        std::vector<size_t> slices = regionSlices(start, end);
+        for (size_t _v : slices) {
+            std::array<int, N> coord = virtualCoord<N>(_dims_sz, _v);
+            walkRegionRows(_v, start, end, [&](int row, int lo, int hi) {
+                coord[N - 2] = row;
+                for (int pos = lo; pos < hi; pos++) {
+                    coord[N - 1] = collst_lst[_v][pos];
+                    op(static_cast<const std::array<int, N>&>(coord),
+                            vallst_lst[_v][pos]);
+                }
+            });
+        }
+    }
+
+    // Summary of a region, default valued cells included.
+    struct Stats {
+        T sum;
+        T min;
+        T max;
+        size_t count; // stored (non default) cells
+        size_t cells; // all cells of region
+    };
+
+    Stats stats(const std::array<int, N> &start,
+            const std::array<int, N> &end) const {
+        std::vector<size_t> slices = regionSlices(start, end);
+        unsigned nworker = parallel::workerCount();
+        std::vector<Partial> part(nworker);
+        parallel::forBalanced(slices.size(),
+                [&](size_t i) {return vallst_lst[slices[i]].size();}, false,
+                [&](size_t i, size_t, size_t, unsigned w) {
+                    size_t _v = slices[i];
+                    const T *vallst = vallst_lst[_v].data();
+                    walkRegionRows(_v, start, end, [&](int, int lo, int hi) {
+                        part[w].add(vallst + lo, hi - lo);
+                    });
+                });
+        Partial all;
+        for (auto& p : part) {
+            all.merge(p);
+        }
+        size_t cells = 1;
+        for (unsigned d = 0; d < N; d++) {
+            cells *= end[d] - start[d];
+        }
+        return finishStats(all, cells);
+    }
+
+    Stats stats() const {
+        std::array<int, N> start;
+        start.fill(0);
+        return stats(start, _dims_sz);
+    }
+
+    T sum(const std::array<int, N> &start, const std::array<int, N> &end) const {
+        return stats(start, end).sum;
+    }
+
+    T sum() const {
+        return stats().sum;
+    }
+
+    /*
+     Stats over all other axes for every index of axis, e.g. for
+     a[t][s][r][c] statsAlong(0)[t] summarises everything at time t.
+     */
+    std::vector<Stats> statsAlong(unsigned axis) const {
+        if (axis >= N) {
+            throw InvalidDimensionsException("Axis out of range.");
+        }
+        checkCompacted();
+        size_t len = _dims_sz[axis];
+        int nrows = _dims_sz[N - 2];
+        unsigned nworker = parallel::workerCount();
+        std::vector<std::vector<Partial> > wpart(nworker,
+                std::vector<Partial>(len));
+        parallel::forBalanced(_virdimsz,
+                [this](size_t _v) {return vallst_lst[_v].size();}, false,
+                [&](size_t _v, size_t, size_t, unsigned w) {
+                    auto& vallst = vallst_lst[_v];
+                    if (vallst.empty()) {
+                        return;
+                    }
+                    auto& rowlst = rowlst_lst[_v];
+                    auto& part = wpart[w];
+                    if (axis + 2 < N) {
+                        size_t idx = virtualCoord<N>(_dims_sz, _v)[axis];
+                        part[idx].add(vallst.data(), vallst.size());
+                    } else if (axis == N - 2) {
+                        for (int row = 0; row < nrows; row++) {
+                            part[row].add(vallst.data() + rowlst[row],
+                                    rowlst[row + 1] - rowlst[row]);
+                        }
+                    } else {
+                        auto& collst = collst_lst[_v];
+                        for (size_t pos = 0; pos < vallst.size(); pos++) {
+                            part[collst[pos]].add(vallst[pos]);
+                        }
+                    }
+                });
+        size_t cells = 1;
+        for (unsigned d = 0; d < N; d++) {
+            cells *= _dims_sz[d];
+        }
+        cells /= len;
+        std::vector<Stats> result;
+        result.reserve(len);
+        for (size_t i = 0; i < len; i++) {
+            for (unsigned w = 1; w < nworker; w++) {
+                wpart[0][i].merge(wpart[w][i]);
+            }
+            result.push_back(finishStats(wpart[0][i], cells));
+        }
+        return result;
+    }
+
+    // Only the sums of statsAlong.
+    std::vector<T> sumAlong(unsigned axis) const {
+        std::vector<Stats> st = statsAlong(axis);
+        std::vector<T> result;
+        result.reserve(st.size());
+        for (auto& s : st) {
+            result.push_back(s.sum);
+        }
+        return result;
+    }
+
     // === Disk save/retrieve ======================================
     int dump(const std::string &path) const {
+        checkCompacted();
         std::ofstream fout(path.c_str(), std::ios::out | std::ios::binary);
         if (!fout) {
             std::cout << "error dump" << 1 <<std::endl;;
@@ -127,10 +564,17 @@ public:
         int sz = _dims_sz.size();
         fout.write((char*) &sz, sizeof(int));
         fout.write((char*) &_dims_sz[0], sz * sizeof(_dims_sz[0]));
-        dumpVOfV(fout, rowlst_lst);
+        // Empty slices hold no row list in memory, but readers of this
+        // format expect one for every slice.
+        int32_t nlst = rowlst_lst.size();
+        fout.write(reinterpret_cast<const char*>(&nlst), sizeof(nlst));
+        for (size_t _v : patch::xrange(rowlst_lst.size())) {
+            dumpV(fout, rowsOf(_v));
+        }
         dumpVOfV(fout, collst_lst);
         dumpVOfV(fout, vallst_lst);
 
+        MDSPARSE_COUNT(_counters, byteswritten, (uint64_t) fout.tellp());
         fout.close();
         return 0;
     }
@@ -147,7 +591,7 @@ public:
         }
         if(errcode > 0){
             std::cout << "error load" << errcode <<std::endl;
-            std::array<T, N> dim;
+            std::array<int, N> dim;
             dim.fill(1);
             return SparseDim<T, N>(dim, T());
         }
@@ -155,7 +599,7 @@ public:
         T defval;
         fin.read(reinterpret_cast<char*>(&defval), sizeof(T));
 
-        std::array<T, N> dim;
+        std::array<int, N> dim;
         int sz;
         fin.read((char*) &sz, sizeof(int));
         assert(sz == N);
@@ -167,36 +611,173 @@ public:
         loadVOfV(fin, sm.collst_lst);
         loadVOfV(fin, sm.vallst_lst);
         fin.close();
+        // Files of older versions have row lists for empty slices too.
+        for (size_t _v : patch::xrange(sm._virdimsz)) {
+            sm.releaseIfEmpty(_v);
+        }
         return sm;
     }
 
+    /*
+     Versioned and aligned format which SparseDimView can mmap and serve
+     without copying, layout in mappedFormat.h. Only slices with data get a
+     row array. T has to be trivially copyable.
+     */
+    int dumpMapped(const std::string &path) const {
+        static_assert(std::is_trivially_copyable<T>::value,
+                "Mapped format needs trivially copyable values");
+        static_assert(sizeof(int) == sizeof(int32_t),
+                "Mapped format stores indexes as int32");
+        checkCompacted();
+        std::ofstream fout(path.c_str(), std::ios::out | std::ios::binary);
+        if (!fout) {
+            std::cout << "error dump" << 1 <<std::endl;
+            return 1;
+        }
+
+        uint64_t nrows = _dims_sz[N - 2];
+        std::vector<MappedSlice> slices(_virdimsz + 1);
+        uint64_t nnz = 0, nrowent = 0;
+        for (size_t _v : patch::xrange(_virdimsz)) {
+            slices[_v].nzbegin = nnz;
+            if (vallst_lst[_v].empty()) {
+                slices[_v].rowbegin = MAPPED_NOROWS;
+            } else {
+                slices[_v].rowbegin = nrowent;
+                nrowent += nrows + 1;
+            }
+            nnz += vallst_lst[_v].size();
+        }
+        slices[_virdimsz].nzbegin = nnz;
+        slices[_virdimsz].rowbegin = nrowent;
+
+        MappedHeader h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, MAPPED_MAGIC, sizeof(h.magic));
+        h.endian = MAPPED_ENDIAN;
+        h.version = MAPPED_VERSION;
+        h.valsize = sizeof(T);
+        h.ndims = N;
+        h.virdimsz = _virdimsz;
+        h.nnz = nnz;
+        h.dimsoff = mappedAlign(sizeof(h));
+        h.defoff = mappedAlign(h.dimsoff + N * sizeof(int32_t));
+        h.sliceoff = mappedAlign(h.defoff + sizeof(T));
+        h.rowoff = mappedAlign(h.sliceoff + slices.size() * sizeof(MappedSlice));
+        h.coloff = mappedAlign(h.rowoff + nrowent * sizeof(int32_t));
+        h.valoff = mappedAlign(h.coloff + nnz * sizeof(int32_t));
+        h.filesize = h.valoff + nnz * sizeof(T);
+
+        uint64_t off = 0;
+        fout.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        off += sizeof(h);
+        mappedPad(fout, off);
+        fout.write(reinterpret_cast<const char*>(&_dims_sz[0]),
+                N * sizeof(int32_t));
+        off += N * sizeof(int32_t);
+        mappedPad(fout, off);
+        fout.write(reinterpret_cast<const char*>(&_defval), sizeof(T));
+        off += sizeof(T);
+        mappedPad(fout, off);
+        fout.write(reinterpret_cast<const char*>(&slices[0]),
+                slices.size() * sizeof(MappedSlice));
+        off += slices.size() * sizeof(MappedSlice);
+        mappedPad(fout, off);
+        for (size_t _v : patch::xrange(_virdimsz)) {
+            if (!vallst_lst[_v].empty()) {
+                fout.write(reinterpret_cast<const char*>(&rowlst_lst[_v][0]),
+                        (nrows + 1) * sizeof(int32_t));
+            }
+        }
+        off += nrowent * sizeof(int32_t);
+        mappedPad(fout, off);
+        for (auto& collst : collst_lst) {
+            fout.write(reinterpret_cast<const char*>(collst.data()),
+                    collst.size() * sizeof(int32_t));
+        }
+        off += nnz * sizeof(int32_t);
+        mappedPad(fout, off);
+        for (auto& vallst : vallst_lst) {
+            fout.write(reinterpret_cast<const char*>(vallst.data()),
+                    vallst.size() * sizeof(T));
+        }
+
+        if (!fout.good()) {
+            std::cout << "error dump" << 2 <<std::endl;
+            return 2;
+        }
+        MDSPARSE_COUNT(_counters, byteswritten, h.filesize);
+        fout.close();
+        return 0;
+    }
+
     // === FRIEND FUNCTIONS =========================================
 
     friend bool operator ==(const SparseDim<T, N> & a,
             const SparseDim<T, N> & b) {
         if (a.printallowed)
             std::cout << __func__ << __LINE__ << std::endl;
+        a.checkCompacted();
+        b.checkCompacted();
         if (a._defval == b._defval) {
-            return ((a.vallst_lst == b.vallst_lst)
-                    && (a.collst_lst == b.collst_lst) // I don't need
-                    && (a.rowlst_lst == b.rowlst_lst) // to check _virdimsz
-                    && (a._dims_sz == b._dims_sz));   // : Derived value
+            if (a._dims_sz != b._dims_sz) { // I don't need to check
+                return false;               // _virdimsz : Derived value
+            }
+            std::atomic<bool> same(true);
+            parallel::forBalanced(a._virdimsz,
+                    [&a](size_t _v) {return a.vallst_lst[_v].size();}, false,
+                    [&](size_t _v, size_t, size_t, unsigned) {
+                        if (same && ((a.vallst_lst[_v] != b.vallst_lst[_v])
+                                || (a.collst_lst[_v] != b.collst_lst[_v])
+                                || (a.rowsOf(_v) != b.rowsOf(_v)))) {
+                            same = false;
+                        }
+                    });
+            return same;
         }
         if (a._dims_sz != b._dims_sz) {
             return false;
         }
-        bool match = true;
-        int vgrp = -1;
-        for (auto arr : mdrange<N>(a._dims_sz)) {
-            if (!arr[N - 2] && !arr[N - 1]) {
-                vgrp++;
-            }
-            if (a._get(arr, vgrp) != b._get(arr, vgrp)) {
-                match = false;
-                break;
-            }
-        }
-        return match;
+        // Defaults differ, so every cell has to be stored on at least one
+        // side, and then values must match. Rows are merged column wise.
+        int nrows = a._dims_sz[N - 2];
+        int ncols = a._dims_sz[N - 1];
+        std::atomic<bool> same(true);
+        parallel::forBalanced(a._virdimsz,
+                [&a, &b](size_t _v) {
+                    return a.vallst_lst[_v].size() + b.vallst_lst[_v].size();
+                }, false, [&](size_t _v, size_t, size_t, unsigned) {
+                    auto& arow = a.rowsOf(_v);
+                    auto& acol = a.collst_lst[_v];
+                    auto& aval = a.vallst_lst[_v];
+                    auto& brow = b.rowsOf(_v);
+                    auto& bcol = b.collst_lst[_v];
+                    auto& bval = b.vallst_lst[_v];
+                    for (int row = 0; same && row < nrows; row++) {
+                        int p = arow[row], pend = arow[row + 1];
+                        int q = brow[row], qend = brow[row + 1];
+                        int covered = 0;
+                        while (p < pend || q < qend) {
+                            bool ok;
+                            if (q == qend || (p < pend && acol[p] < bcol[q])) {
+                                ok = aval[p++] == b._defval;
+                            } else if (p == pend || bcol[q] < acol[p]) {
+                                ok = a._defval == bval[q++];
+                            } else {
+                                ok = aval[p++] == bval[q++];
+                            }
+                            if (!ok) {
+                                same = false;
+                                return;
+                            }
+                            covered++;
+                        }
+                        if (covered != ncols) {
+                            same = false;
+                        }
+                    }
+                });
+        return same;
     }
 
     friend bool operator !=(const SparseDim<T, N> & a,
@@ -211,7 +792,7 @@ public:
         for (int _virtualidx : patch::xrange(sd._virdimsz)) {
             std::cout << "Struct{" << _virtualidx << "::";
             std::cout << "\nR::";
-            for (auto i : sd.rowlst_lst[_virtualidx]) {
+            for (auto i : sd.rowsOf(_virtualidx)) {
                 os << i << " ";
             }
             std::cout << "\nC::";
@@ -232,34 +813,306 @@ protected:
     size_t _virdimsz;
     std::vector<std::vector<T> > vallst_lst;
     std::vector<std::vector<int> > rowlst_lst, collst_lst;
+    std::vector<int> _zerorows; // rows + 1 zeros, rows of an empty slice
     T _defval;
     int printallowed;
+    mutable PerfCounterSet _counters;
+
+    // Pending writes of the write buffer, keyed by (virdim, row, col).
+    // A value equal to _defval marks a cell to be removed on compact.
+    struct StageKey {
+        size_t v;
+        int row, col;
+        bool operator ==(const StageKey &o) const {
+            return v == o.v && row == o.row && col == o.col;
+        }
+        bool operator <(const StageKey &o) const {
+            if (v != o.v)
+                return v < o.v;
+            if (row != o.row)
+                return row < o.row;
+            return col < o.col;
+        }
+    };
+    struct StageKeyHash {
+        size_t operator()(const StageKey &k) const {
+            size_t h = std::hash<size_t>()(k.v);
+            h ^= std::hash<int>()(k.row) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            h ^= std::hash<int>()(k.col) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            return h;
+        }
+    };
+    std::unordered_map<StageKey, T, StageKeyHash> _stage;
+    size_t _stagelimit; // 0 means write buffer is off
+
+    struct CooEntry {
+        StageKey key;
+        size_t seq; // input order, to fold duplicates in order
+        T val;
+        bool operator <(const CooEntry &o) const {
+            if (key == o.key)
+                return seq < o.seq;
+            return key < o.key;
+        }
+    };
+
+    struct LastWins {
+        T operator()(const T &, const T &next) const {
+            return next;
+        }
+    };
+
+    void addEntry(std::vector<CooEntry> &entries,
+            const std::array<int, N> &coord, const T &val) const {
+        size_t _v = validateGetVirtualDim(coord);
+        entries.push_back(CooEntry { StageKey { _v, coord[N - 2],
+                coord[N - 1] }, entries.size(), val });
+    }
+
+    // Expects a freshly created (empty) array.
+    template<typename CombineType>
+    void buildFromCOO(std::vector<CooEntry> &entries, CombineType combine) {
+        parallel::sort(entries.begin(), entries.end(),
+                [](const CooEntry &a, const CooEntry &b) {return a < b;});
+
+        // Fold duplicates and drop default values, counting per slice.
+        std::vector<size_t> nnz(_virdimsz, 0);
+        size_t out = 0;
+        for (size_t i = 0; i < entries.size();) {
+            size_t j = i + 1;
+            T val = entries[i].val;
+            for (; j < entries.size() && entries[j].key == entries[i].key;
+                    j++) {
+                val = combine(val, entries[j].val);
+            }
+            if (val != _defval) {
+                entries[out] = entries[i];
+                entries[out].val = val;
+                nnz[entries[out].key.v]++;
+                out++;
+            }
+            i = j;
+        }
+        entries.resize(out);
+
+        int nrows = _dims_sz[N - 2];
+        size_t i = 0;
+        for (size_t _v : patch::xrange(_virdimsz)) {
+            if (!nnz[_v]) {
+                continue;
+            }
+            MDSPARSE_COUNT(_counters, allocations, 2);
+            auto& rowlst = rowsFor(_v);
+            std::vector<int> collst;
+            std::vector<T> vallst;
+            collst.reserve(nnz[_v]);
+            vallst.reserve(nnz[_v]);
+            std::fill(rowlst.begin(), rowlst.end(), 0);
+            for (; i < entries.size() && entries[i].key.v == _v; i++) {
+                rowlst[entries[i].key.row + 1]++;
+                collst.push_back(entries[i].key.col);
+                vallst.push_back(entries[i].val);
+            }
+            for (int row : patch::xrange(nrows)) {
+                rowlst[row + 1] += rowlst[row];
+            }
+            collst_lst[_v].swap(collst);
+            vallst_lst[_v].swap(vallst);
+        }
+    }
+
+    // Running sum/min/max of stored values. add() keeps four independent
+    // lanes so the loop has no carried dependency and gets vectorised.
+    struct Partial {
+        T sum, min, max;
+        size_t count;
+
+        Partial() :
+                sum(), min(), max(), count(0) {
+        }
+
+        void add(const T *vals, size_t n) {
+            if (!n) {
+                return;
+            }
+            T s[4] = { T(), T(), T(), T() };
+            T lo[4] = { vals[0], vals[0], vals[0], vals[0] };
+            T hi[4] = { vals[0], vals[0], vals[0], vals[0] };
+            size_t i = 0;
+            for (; i + 3 < n; i += 4) {
+                for (int l = 0; l < 4; l++) {
+                    const T &v = vals[i + l];
+                    s[l] += v;
+                    lo[l] = (v < lo[l]) ? v : lo[l];
+                    hi[l] = (hi[l] < v) ? v : hi[l];
+                }
+            }
+            for (; i < n; i++) {
+                s[0] += vals[i];
+                lo[0] = (vals[i] < lo[0]) ? vals[i] : lo[0];
+                hi[0] = (hi[0] < vals[i]) ? vals[i] : hi[0];
+            }
+            Partial p;
+            p.sum = (s[0] + s[1]) + (s[2] + s[3]);
+            p.min = std::min(std::min(lo[0], lo[1]), std::min(lo[2], lo[3]));
+            p.max = std::max(std::max(hi[0], hi[1]), std::max(hi[2], hi[3]));
+            p.count = n;
+            merge(p);
+        }
+
+        void add(const T &v) {
+            if (!count) {
+                sum = min = max = v;
+            } else {
+                sum += v;
+                min = (v < min) ? v : min;
+                max = (max < v) ? v : max;
+            }
+            count++;
+        }
+
+        void merge(const Partial &p) {
+            if (!p.count) {
+                return;
+            }
+            if (!count) {
+                *this = p;
+                return;
+            }
+            sum += p.sum;
+            min = (p.min < min) ? p.min : min;
+            max = (max < p.max) ? p.max : max;
+            count += p.count;
+        }
+    };
+
+    // Stats of cells, stored ones summarised by p, rest hold _defval.
+    Stats finishStats(const Partial &p, size_t cells) const {
+        Stats st;
+        st.cells = cells;
+        st.count = p.count;
+        st.sum = p.sum;
+        st.min = p.count ? p.min : _defval;
+        st.max = p.count ? p.max : _defval;
+        if (st.cells > st.count) {
+            st.sum += _defval * static_cast<T>(st.cells - st.count);
+            st.min = (_defval < st.min) ? _defval : st.min;
+            st.max = (st.max < _defval) ? _defval : st.max;
+        }
+        return st;
+    }
+
+    // Virtual slices crossing region [start, end), region is validated.
+    std::vector<size_t> regionSlices(const std::array<int, N> &start,
+            const std::array<int, N> &end) const {
+        checkCompacted();
+        for (unsigned d = 0; d < N; d++) {
+            if (start[d] < 0 || end[d] > _dims_sz[d] || start[d] >= end[d]) {
+                throw InvalidDimensionsException("Wrong region.");
+            }
+        }
+        std::vector<size_t> slices;
+        std::array<int, N> lead = start;
+        for (;;) {
+            size_t _v = virtualIndex<N>(_dims_sz, lead);
+            if (!vallst_lst[_v].empty()) {
+                slices.push_back(_v);
+            }
+            // Next combination of leading coordinates, last one fastest
+            int d = (int) N - 3;
+            for (; d >= 0; d--) {
+                if (++lead[d] < end[d]) {
+                    break;
+                }
+                lead[d] = start[d];
+            }
+            if (d < 0) {
+                break;
+            }
+        }
+        return slices;
+    }
+
+    // Calls op(row, lo, hi) with position range of each row of slice _v
+    // which has columns inside region.
+    template<typename RowOpType>
+    void walkRegionRows(size_t _v, const std::array<int, N> &start,
+            const std::array<int, N> &end, RowOpType op) const {
+        auto& rowlst = rowlst_lst[_v];
+        auto& collst = collst_lst[_v];
+        int clo = start[N - 1], chi = end[N - 1];
+        bool allcols = (clo == 0 && chi == _dims_sz[N - 1]);
+        for (int row = start[N - 2]; row < end[N - 2]; row++) {
+            int lo = rowlst[row], hi = rowlst[row + 1];
+            if (lo == hi) {
+                continue;
+            }
+            if (!allcols) {
+                auto b = collst.begin();
+                lo = std::lower_bound(b + lo, b + hi, clo) - b;
+                hi = std::lower_bound(b + lo, b + hi, chi) - b;
+            }
+            if (lo < hi) {
+                op(row, lo, hi);
+            }
+        }
+    }
+
+    inline void checkCompacted() const {
+        if (!_stage.empty()) {
+            throw InvalidStateException(
+                    "Buffered writes pending, call compact() first.");
+        }
+    }
 
     template<typename UniOpType>
     inline SparseDim<T, N> _oper(UniOpType op, bool cacheval) const {
         SparseDim<T, N> result(*this);
-        op(result._defval);
+        result._apply(op, cacheval);
+        return result;
+    }
+
+    // Same as _oper but changes this in place, used when the operand is
+    // a temporary and copying it would be wasted.
+    template<typename UniOpType>
+    inline void _apply(UniOpType op, bool cacheval) {
+        compact();
+        T olddef = _defval;
+        op(_defval);
+        // Slices (and parts of big ones) run on the pool, every worker
+        // has its own copy of op and its own memo of seen values.
+        unsigned nworker = parallel::workerCount();
+        std::vector<UniOpType> ops(nworker, op);
+        auto nnz = [this](size_t _v) {return vallst_lst[_v].size();};
         if (cacheval) {
-            std::unordered_map<T, T> values;
-            values.insert( { this->_defval, result._defval });
-            for (auto& vallst : result.vallst_lst) {
-                for (T &i : vallst) {
-                    if (!values.count(i)) {
-                        T j = i;
-                        op(j);
-                        values.insert( { i, j });
-                    }
-                    i = values.at(i);
-                }
+            std::vector<std::unordered_map<T, T> > memo(nworker);
+            for (auto& values : memo) {
+                values.insert( { olddef, _defval });
             }
+            parallel::forBalanced(_virdimsz, nnz, true,
+                    [&](size_t _v, size_t from, size_t to, unsigned w) {
+                        auto& values = memo[w];
+                        auto& vallst = vallst_lst[_v];
+                        for (size_t pos = from; pos < to; pos++) {
+                            T &i = vallst[pos];
+                            auto it = values.find(i);
+                            if (it == values.end()) {
+                                T j = i;
+                                ops[w](j);
+                                it = values.insert( { i, j }).first;
+                            }
+                            i = it->second;
+                        }
+                    });
         } else {
-            for (auto& vallst : result.vallst_lst) {
-                for (T &i : vallst) {
-                    op(i);
-                }
-            }
+            parallel::forBalanced(_virdimsz, nnz, true,
+                    [&](size_t _v, size_t from, size_t to, unsigned w) {
+                        auto& vallst = vallst_lst[_v];
+                        for (size_t pos = from; pos < to; pos++) {
+                            ops[w](vallst[pos]);
+                        }
+                    });
         }
-        return result;
     }
 
     // === HELPERS / VALIDATORS ==============================================
@@ -269,19 +1122,44 @@ protected:
             std::cout << __func__ << __LINE__ << std::endl;
         this->_virdimsz = sd._virdimsz;
         this->_defval = sd._defval;
+        this->_stage = sd._stage;
+        this->_stagelimit = sd._stagelimit;
         std::copy(std::begin(sd._dims_sz), std::end(sd._dims_sz),
                 std::begin(_dims_sz));
         this->vallst_lst = std::vector<std::vector<T> >(_virdimsz);
         this->collst_lst = std::vector<std::vector<int> >(_virdimsz);
         this->rowlst_lst = std::vector<std::vector<int> >(_virdimsz);
-        for (int i : patch::xrange(_virdimsz)) {
-            this->vallst_lst[i] = std::vector<T>(sd.vallst_lst[i]);
-            this->vallst_lst[i].reserve(10);
-            this->collst_lst[i] = std::vector<int>(sd.collst_lst[i]);
-            this->collst_lst[i].reserve(10);
-            // We make row one size larger in CSR
-            this->rowlst_lst[i] = std::vector<int>(sd.rowlst_lst[i]);
-        }
+        this->_zerorows = sd._zerorows;
+        MDSPARSE_COUNT(_counters, allocations, 4);
+        parallel::forBalanced(_virdimsz,
+                [&sd](size_t i) {
+                    return sd.vallst_lst[i].size() + sd.rowlst_lst[i].size();
+                },
+                false, [&](size_t i, size_t, size_t, unsigned) {
+                    this->vallst_lst[i] = std::vector<T>(sd.vallst_lst[i]);
+                    this->collst_lst[i] = std::vector<int>(sd.collst_lst[i]);
+                    // We make row one size larger in CSR
+                    this->rowlst_lst[i] = std::vector<int>(sd.rowlst_lst[i]);
+                    if (!sd.vallst_lst[i].empty()) {
+                        MDSPARSE_COUNT(_counters, allocations, 3);
+                    }
+                });
+    }
+
+    void moveFrom(SparseDim<T, N> & sd) {
+        this->_virdimsz = sd._virdimsz;
+        this->_defval = sd._defval;
+        this->_dims_sz = sd._dims_sz;
+        this->vallst_lst = std::move(sd.vallst_lst);
+        this->collst_lst = std::move(sd.collst_lst);
+        this->rowlst_lst = std::move(sd.rowlst_lst);
+        this->_zerorows = sd._zerorows;
+        this->_counters.absorb(sd._counters);
+        sd._counters.reset();
+        this->_stage = std::move(sd._stage);
+        this->_stagelimit = sd._stagelimit;
+        // Leave the source as an empty but consistent object.
+        sd._virdimsz = 0;
     }
 
     inline size_t validateGetVirtualDim(
@@ -314,23 +1192,29 @@ protected:
         // No bound check. It will make it slower
         if (printallowed > 1)
             std::cout << __func__ << __LINE__ << std::endl;
-        int currCol;
         if (_virtualidx == -1) {
             _virtualidx = this->validateGetVirtualDim(atloc);
         }
         int row = atloc[N - 2];
         int col = atloc[N - 1];
+        if (!_stage.empty()) {
+            auto it = _stage.find(StageKey { (size_t) _virtualidx, row, col });
+            if (it != _stage.end()) {
+                return it->second;
+            }
+        }
         auto& rowlst = this->rowlst_lst[_virtualidx];
         auto& collst = this->collst_lst[_virtualidx];
-        int pos;
-        for (pos = rowlst[row]; pos < rowlst[row + 1]; pos++) {
-            currCol = collst[pos];
-
-            if (currCol == col) {
-                return this->vallst_lst[_virtualidx][pos];
-            } else if (currCol > col) {
-                break;
-            }
+        if (rowlst.empty()) {
+            return _defval; // nothing stored in slice
+        }
+        MDSPARSE_COUNT(_counters, probes, 1);
+        MDSPARSE_COUNT(_counters, probelen, rowlst[row + 1] - rowlst[row]);
+        // Columns of a row are sorted
+        auto end = collst.begin() + rowlst[row + 1];
+        auto pos = std::lower_bound(collst.begin() + rowlst[row], end, col);
+        if (pos != end && *pos == col) {
+            return this->vallst_lst[_virtualidx][pos - collst.begin()];
         }
         return _defval;
     }
@@ -340,25 +1224,33 @@ protected:
         // No bound check. It will make it slower
         if (printallowed > 1)
             std::cout << __func__ << __LINE__ << std::endl;
-        int currCol = -1;
         if (_virtualidx == -1) {
             _virtualidx = this->validateGetVirtualDim(atloc);
         }
 
         int row = atloc[N - 2];
         int col = atloc[N - 1];
+        if (_stagelimit) {
+            _stage[StageKey { (size_t) _virtualidx, row, col }] = val;
+            if (_stage.size() >= _stagelimit) {
+                compact();
+            }
+            return;
+        }
+        if (this->rowlst_lst[_virtualidx].empty()) {
+            if (val == _defval) {
+                return; // nothing stored in slice, noop
+            }
+            rowsFor(_virtualidx);
+        }
         auto& rowlst = this->rowlst_lst[_virtualidx];
         auto& collst = this->collst_lst[_virtualidx];
         auto& vallst = this->vallst_lst[_virtualidx];
-        int pos;
-        for (pos = rowlst[row]; pos < rowlst[row + 1]; pos++) {
-            currCol = collst[pos];
-
-            if (currCol >= col) {
-                break;
-            }
-        }
-        if (currCol != col) {
+        MDSPARSE_COUNT(_counters, probes, 1);
+        MDSPARSE_COUNT(_counters, probelen, rowlst[row + 1] - rowlst[row]);
+        int pos = std::lower_bound(collst.begin() + rowlst[row],
+                collst.begin() + rowlst[row + 1], col) - collst.begin();
+        if (pos == rowlst[row + 1] || collst[pos] != col) {
             if (val == _defval) {
                 //its not there and we will not insert defval, so its noop
                 return;
@@ -380,6 +1272,11 @@ protected:
             std::cout << __func__ << __LINE__ << ":" << val << std::endl;
         auto& vallst = this->vallst_lst[_virtualidx];
         auto& collst = this->collst_lst[_virtualidx];
+        if (vallst.size() == vallst.capacity()) {
+            MDSPARSE_COUNT(_counters, allocations, 2);
+        }
+        MDSPARSE_COUNT(_counters, shifts,
+                2 * (vallst.size() - dataindex) + _dims_sz[N - 2] - row);
         if (vallst.size() == 0) {
             vallst.push_back(val);
             collst.push_back(col);
@@ -400,6 +1297,8 @@ protected:
             std::cout << __func__ << __LINE__ << std::endl;
         auto& vallst = this->vallst_lst[_virtualidx];
         auto& collst = this->collst_lst[_virtualidx];
+        MDSPARSE_COUNT(_counters, shifts,
+                2 * (vallst.size() - dataindex - 1) + _dims_sz[N - 2] - row);
         vallst.erase(vallst.begin() + dataindex);
         collst.erase(collst.begin() + dataindex);
 
@@ -407,31 +1306,63 @@ protected:
             // We make row one size larger in CSR
             this->rowlst_lst[_virtualidx][i] -= 1;
         }
+        releaseIfEmpty(_virtualidx);
+    }
+
+    // Row list of slice _v, shared zeros when slice is empty.
+    inline const std::vector<int>& rowsOf(size_t _v) const {
+        return rowlst_lst[_v].empty() ? _zerorows : rowlst_lst[_v];
+    }
+
+    // Row list of slice _v, allocated if slice was empty.
+    inline std::vector<int>& rowsFor(size_t _v) {
+        auto& rowlst = rowlst_lst[_v];
+        if (rowlst.empty()) {
+            MDSPARSE_COUNT(_counters, allocations, 1);
+            rowlst = _zerorows;
+        }
+        return rowlst;
+    }
+
+    // Gives memory of a slice with no stored cell back.
+    inline void releaseIfEmpty(size_t _v) {
+        if (vallst_lst[_v].empty()) {
+            std::vector<T>().swap(vallst_lst[_v]);
+            std::vector<int>().swap(collst_lst[_v]);
+            std::vector<int>().swap(rowlst_lst[_v]);
+        }
     }
 
 private:
+    // Legacy headerless layout, kept as is so older files and readers
+    // still work: counts are 32 bit ints in host byte order.
+    template<typename T1>
+    static void dumpV(std::ofstream &fout, const std::vector<T1>& v) {
+        int32_t sz = v.size();
+        fout.write(reinterpret_cast<const char*>(&sz), sizeof(sz));
+        fout.write(reinterpret_cast<const char*>(v.data()), sz * sizeof(T1));
+    }
+
     template<typename T1>
     void dumpVOfV(std::ofstream &fout,
             const std::vector<std::vector<T1>>& vOfv) const {
-        auto sz = vOfv.size();
-        fout.write(reinterpret_cast<const char*>(&sz), sizeof(int));
-        for (auto _v : vOfv) {
-            sz = _v.size();
-            fout.write(reinterpret_cast<const char*>(&sz), sizeof(int));
-            fout.write(reinterpret_cast<const char*>(&_v[0]), sz * sizeof(T1));
+        int32_t sz = vOfv.size();
+        fout.write(reinterpret_cast<const char*>(&sz), sizeof(sz));
+        for (auto& _v : vOfv) {
+            dumpV(fout, _v);
         }
     }
 
     template<typename T1>
     static void loadVOfV(std::ifstream &fin,
             std::vector<std::vector<T1>>& vOfv) {
-        int sz;
-        fin.read(reinterpret_cast<char*>(&sz), sizeof(int));
+        int32_t sz;
+        fin.read(reinterpret_cast<char*>(&sz), sizeof(sz));
         vOfv.resize(sz);
         for (auto& _v : vOfv) {
-            fin.read(reinterpret_cast<char*>(&sz), sizeof(int));
+            fin.read(reinterpret_cast<char*>(&sz), sizeof(sz));
             _v.resize(sz);
-            fin.read(reinterpret_cast<char*>(&_v[0]), sz * sizeof(T1));
+            fin.read(reinterpret_cast<char*>(_v.data()), sz * sizeof(T1));
         }
     }
 
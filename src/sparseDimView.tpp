@@ -0,0 +1,364 @@
+/**
+ * This file is part of the MultiDimSparseArray library
+ *
+ * @license  BSD-3
+ * @author   Abhilekh Agarwal
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mappedFormat.h"
+#include "sparseDim.tpp"
+
+/*
+ Read only view on a file written by SparseDim::dumpMapped. File is mmap'ed
+ and get/iteration read the arrays in place, so opening costs the same
+ whatever the file size. Kernel only pages in the slices which are touched
+ (access is advised as random, so there is no read ahead of whole file);
+ prefetch() can be used to ask for a slice before it is needed.
+ */
+
+template<typename T, unsigned N = 2>
+class SparseDimView {
+public:
+
+    // === CREATION ==============================================
+    // errcode: 1 cannot open, 2 cannot map, 3 not a mapped file or
+    // unknown version, 4 other endianness, 5 type or dimension mismatch.
+    SparseDimView(const std::string &path, int &errcode) :
+            _base(nullptr), _size(0) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                "Mapped format needs trivially copyable values");
+        errcode = map(path);
+        if (errcode > 0) {
+            std::cout << "error load" << errcode << std::endl;
+            unmap();
+        }
+    }
+
+    SparseDimView(SparseDimView<T, N> && view) :
+            _base(nullptr), _size(0) {
+        steal(view);
+    }
+
+    SparseDimView<T, N> & operator =(SparseDimView<T, N> && view) {
+        if (&view != this) {
+            unmap();
+            steal(view);
+        }
+        return *this;
+    }
+
+    SparseDimView(const SparseDimView<T, N> &) = delete;
+    SparseDimView<T, N> & operator =(const SparseDimView<T, N> &) = delete;
+
+    ~SparseDimView() {
+        unmap();
+    }
+
+    inline bool valid() const {
+        return _base != nullptr;
+    }
+
+    // === VALUES ==============================================
+
+    T get(const std::array<int, N> &atloc) const {
+        size_t _v = validateGetVirtualDim(atloc);
+        const MappedSlice &slice = _slices[_v];
+        if (slice.rowbegin == MAPPED_NOROWS) {
+            return _defval;
+        }
+        const int32_t *rowlst = _rows + slice.rowbegin;
+        const int32_t *collst = _cols + slice.nzbegin;
+        int row = atloc[N - 2];
+        int col = atloc[N - 1];
+        checkRow(_v, rowlst[row], rowlst[row + 1]);
+        const int32_t *end = collst + rowlst[row + 1];
+        const int32_t *pos = std::lower_bound(collst + rowlst[row], end, col);
+        if (pos != end && *pos == col) {
+            return _vals[slice.nzbegin + (pos - collst)];
+        }
+        return _defval;
+    }
+
+    inline int getdimensions() const {
+        return N;
+    }
+
+    inline unsigned getdimensionsSize(unsigned d) const {
+        return (d < N) ? _dims_sz[d] : 0;
+    }
+
+    inline T getDefault() const {
+        return _defval;
+    }
+
+    inline size_t getVirtualDimSize() const {
+        return _virdimsz;
+    }
+
+    inline size_t nnz() const {
+        return valid() ? _hdr->nnz : 0;
+    }
+
+    // Calls op(coord, value) for each stored cell, in index order.
+    template<typename NzOpType>
+    void forEachNonzero(NzOpType op) const {
+        for (size_t _v = 0; _v < _virdimsz; _v++) {
+            forEachNonzero(_v, op);
+        }
+    }
+
+    // Same for one virtual slice only.
+    template<typename NzOpType>
+    void forEachNonzero(size_t _v, NzOpType op) const {
+        validateSlice(_v);
+        const MappedSlice &slice = _slices[_v];
+        if (slice.rowbegin == MAPPED_NOROWS) {
+            return;
+        }
+        std::array<int, N> coord = virtualCoord<N>(_dims_sz, _v);
+        const int32_t *rowlst = _rows + slice.rowbegin;
+        const int32_t *collst = _cols + slice.nzbegin;
+        const T *vallst = _vals + slice.nzbegin;
+        for (int row = 0; row < _dims_sz[N - 2]; row++) {
+            coord[N - 2] = row;
+            checkRow(_v, rowlst[row], rowlst[row + 1]);
+            for (int pos = rowlst[row]; pos < rowlst[row + 1]; pos++) {
+                coord[N - 1] = collst[pos];
+                op(static_cast<const std::array<int, N>&>(coord), vallst[pos]);
+            }
+        }
+    }
+
+    // Ask kernel to start reading slice _v in background.
+    void prefetch(size_t _v) const {
+        validateSlice(_v);
+        const MappedSlice &slice = _slices[_v];
+        const MappedSlice &next = _slices[_v + 1];
+        if (slice.rowbegin == MAPPED_NOROWS) {
+            return;
+        }
+        advise(_rows + slice.rowbegin, (_dims_sz[N - 2] + 1) * sizeof(int32_t));
+        advise(_cols + slice.nzbegin,
+                (next.nzbegin - slice.nzbegin) * sizeof(int32_t));
+        advise(_vals + slice.nzbegin, (next.nzbegin - slice.nzbegin) * sizeof(T));
+    }
+
+    // Copies view into a regular writable array.
+    SparseDim<T, N> toSparseDim() const {
+        if (!valid()) {
+            throw InvalidStateException("View is not mapped.");
+        }
+        SparseDim<T, N> sd(_dims_sz, _defval);
+        for (size_t _v = 0; _v < _virdimsz; _v++) {
+            const MappedSlice &slice = _slices[_v];
+            const MappedSlice &next = _slices[_v + 1];
+            if (slice.rowbegin == MAPPED_NOROWS) {
+                continue;
+            }
+            const int32_t *rowlst = _rows + slice.rowbegin;
+            for (int row = 0; row < _dims_sz[N - 2]; row++) {
+                checkRow(_v, rowlst[row], rowlst[row + 1]);
+            }
+            sd.rowlst_lst[_v].assign(rowlst, rowlst + _dims_sz[N - 2] + 1);
+            sd.collst_lst[_v].assign(_cols + slice.nzbegin,
+                    _cols + next.nzbegin);
+            sd.vallst_lst[_v].assign(_vals + slice.nzbegin,
+                    _vals + next.nzbegin);
+        }
+        return sd;
+    }
+
+private:
+    char *_base;
+    size_t _size;
+    const MappedHeader *_hdr;
+    std::array<int, N> _dims_sz;
+    size_t _virdimsz;
+    T _defval;
+    const MappedSlice *_slices;
+    const int32_t *_rows, *_cols;
+    const T *_vals;
+
+    int map(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return 2;
+        }
+        if (st.st_size < (off_t) sizeof(MappedHeader)) {
+            ::close(fd);
+            return 3;
+        }
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return 2;
+        }
+        _base = static_cast<char*>(addr);
+        _size = st.st_size;
+        madvise(_base, _size, MADV_RANDOM);
+
+        _hdr = reinterpret_cast<const MappedHeader*>(_base);
+        if (std::memcmp(_hdr->magic, MAPPED_MAGIC, sizeof(_hdr->magic)) != 0) {
+            return 3;
+        }
+        if (_hdr->endian != MAPPED_ENDIAN) {
+            return 4;
+        }
+        if (_hdr->version != MAPPED_VERSION || _hdr->filesize != _size) {
+            return 3;
+        }
+        if (_hdr->valsize != sizeof(T) || _hdr->ndims != N) {
+            return 5;
+        }
+        // Sections aligned, in order and inside the file. Sizes of slice
+        // table and rows are checked once they are known.
+        uint64_t nnz = _hdr->nnz;
+        if (nnz > _size / sizeof(T)) {
+            return 3;
+        }
+        const uint64_t offs[] = { _hdr->dimsoff, _hdr->defoff, _hdr->sliceoff,
+                _hdr->rowoff, _hdr->coloff, _hdr->valoff };
+        uint64_t prev = sizeof(MappedHeader);
+        for (uint64_t off : offs) {
+            if (off % MAPPED_ALIGN != 0 || off < prev || off > _size) {
+                return 3;
+            }
+            prev = off;
+        }
+        if (_hdr->dimsoff + N * sizeof(int32_t) > _hdr->defoff
+                || _hdr->defoff + sizeof(T) > _hdr->sliceoff
+                || _hdr->coloff + nnz * sizeof(int32_t) > _hdr->valoff
+                || _hdr->valoff + nnz * sizeof(T) > _size) {
+            return 3;
+        }
+        std::memcpy(&_dims_sz[0], _base + _hdr->dimsoff, N * sizeof(int32_t));
+        std::memcpy(&_defval, _base + _hdr->defoff, sizeof(T));
+        _virdimsz = 1;
+        for (unsigned i = 0; i < N; i++) {
+            if (_dims_sz[i] < 1) {
+                return 5;
+            }
+            if (i < N - 2) {
+                _virdimsz *= _dims_sz[i];
+            }
+        }
+        if (_virdimsz != _hdr->virdimsz) {
+            return 5;
+        }
+        if ((_hdr->rowoff - _hdr->sliceoff) / sizeof(MappedSlice)
+                < _virdimsz + 1) {
+            return 3;
+        }
+        _slices = reinterpret_cast<const MappedSlice*>(_base + _hdr->sliceoff);
+        // Slice table: starts ascending from 0 to nnz, row arrays one after
+        // other and only for non empty slices.
+        uint64_t nrowent = 0;
+        uint64_t rowsz = _dims_sz[N - 2] + 1;
+        if (_slices[0].nzbegin != 0 || _slices[_virdimsz].nzbegin != nnz) {
+            return 3;
+        }
+        for (size_t _v = 0; _v < _virdimsz; _v++) {
+            const MappedSlice &slice = _slices[_v];
+            uint64_t next = _slices[_v + 1].nzbegin;
+            if (next < slice.nzbegin) {
+                return 3;
+            }
+            if (slice.rowbegin == MAPPED_NOROWS) {
+                if (next != slice.nzbegin) {
+                    return 3;
+                }
+            } else if (slice.rowbegin != nrowent || next == slice.nzbegin) {
+                return 3;
+            } else {
+                nrowent += rowsz;
+            }
+        }
+        if (_slices[_virdimsz].rowbegin != nrowent
+                || nrowent > (_hdr->coloff - _hdr->rowoff) / sizeof(int32_t)) {
+            return 3;
+        }
+        _rows = reinterpret_cast<const int32_t*>(_base + _hdr->rowoff);
+        _cols = reinterpret_cast<const int32_t*>(_base + _hdr->coloff);
+        _vals = reinterpret_cast<const T*>(_base + _hdr->valoff);
+        return 0;
+    }
+
+    void unmap() {
+        if (_base) {
+            munmap(_base, _size);
+        }
+        _base = nullptr;
+        _size = 0;
+        _virdimsz = 0;
+    }
+
+    void steal(SparseDimView<T, N> &view) {
+        _base = view._base;
+        _size = view._size;
+        _hdr = view._hdr;
+        _dims_sz = view._dims_sz;
+        _virdimsz = view._virdimsz;
+        _defval = view._defval;
+        _slices = view._slices;
+        _rows = view._rows;
+        _cols = view._cols;
+        _vals = view._vals;
+        view._base = nullptr;
+        view._size = 0;
+        view._virdimsz = 0;
+    }
+
+    void advise(const void *addr, size_t len) const {
+        if (!len) {
+            return;
+        }
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t b = reinterpret_cast<uintptr_t>(addr) / page * page;
+        uintptr_t e = reinterpret_cast<uintptr_t>(addr) + len;
+        madvise(reinterpret_cast<void*>(b), e - b, MADV_WILLNEED);
+    }
+
+    // Row bounds are read from the file, they are checked on use so that
+    // opening does not have to touch every row array.
+    inline void checkRow(size_t _v, int32_t lo, int32_t hi) const {
+        uint64_t nnz = _slices[_v + 1].nzbegin - _slices[_v].nzbegin;
+        if (lo < 0 || hi < lo || (uint64_t) hi > nnz) {
+            throw InvalidStateException("Corrupt row array in mapped file.");
+        }
+    }
+
+    inline size_t validateGetVirtualDim(const std::array<int, N> &coord) const {
+        if (!valid()) {
+            throw InvalidStateException("View is not mapped.");
+        }
+        return virtualIndex<N>(_dims_sz, coord);
+    }
+
+    inline void validateSlice(size_t _v) const {
+        if (!valid()) {
+            throw InvalidStateException("View is not mapped.");
+        }
+        if (_v >= _virdimsz) {
+            throw InvalidCoordinatesException("Virtual slice out of range.");
+        }
+    }
+};
@@ -11,7 +11,8 @@
 #include <algorithm>
 #include <map>
 #include <vector>
-#include "MultiDim.tpp"
+#include "multiDim.tpp"
+#include "parallel.tpp"
 
 template<typename T>
 class SparseMatrix: public MultiDim<T, 2U> {
@@ -32,6 +33,18 @@ public:
         //this->printallowed = 1;
     }
 
+    SparseMatrix(MultiDim<T, 2U> && matrix) :
+        MultiDim<T, 2U>(std::move(matrix)) {  // Constructor 4
+    }
+
+    SparseMatrix(const SparseMatrix<T> & matrix) :
+        MultiDim<T, 2U>(matrix) {  // copy constructor
+    }
+
+    SparseMatrix(SparseMatrix<T> && matrix) :
+        MultiDim<T, 2U>(std::move(matrix)) {  // move constructor
+    }
+
     SparseMatrix<T> & operator =(const SparseMatrix<T> & matrix) {
         if (&matrix != this) {
             this->deepCopy(matrix);
@@ -55,6 +68,20 @@ public:
         return *this;
     }
 
+    SparseMatrix<T> & operator =(SparseMatrix<T> && matrix) {
+        if (&matrix != this) {
+            this->moveFrom(matrix);
+        }
+        return *this;
+    }
+
+    SparseMatrix<T> & operator =(MultiDim<T, 2U> && matrix) {
+        if (&matrix != this) {
+            this->moveFrom(matrix);
+        }
+        return *this;
+    }
+
     // === GETTERS / SETTERS ==============================================
     int getRowCount(void) const {
         return this->_dims_sz[0];
@@ -76,54 +103,202 @@ public:
 
     // === OPERATIONS ==============================================
 
-    using MultiDim<T, 2U>::operator *;
-    std::vector<T> operator *(const std::vector<T> & x) const {
+    // Only the scalar product of MultiDim is exported. Its element wise
+    // product would be an exact match for a MultiDim operand such as
+    // a * (b + c), which has to convert to SparseMatrix for matrix product.
+    MultiDim<T, 2U> operator *(const T &t) const & {
+        return static_cast<const MultiDim<T, 2U> &>(*this) * t;
+    }
 
-        if (this->_ncols != (int) x.size()) {
+    MultiDim<T, 2U> operator *(const T &t) && {
+        return static_cast<MultiDim<T, 2U> &&>(*this) * t;
+    }
+
+    SparseMatrix<T> & operator *=(const SparseMatrix<T> & m) {
+        return *this = *this * m;
+    }
+
+    std::vector<T> operator *(const std::vector<T> & x) const {
+        if (this->getColumnCount() != (int) x.size()) {
             throw InvalidDimensionsException(
                     "Cannot multiply: Matrix column count and vector size don't match.");
         }
-        std::vector<T> result(this->_nrows, this->_defval);
-        if (this->vallst.size() == 0) { // only if any value set
-            return result;
-        }
-        for (int i = 0; i < this->_nrows; i++) {
-            T sum = T();
-            for (int j = this->rowlst.at(i); j < this->rowlst.at(i + 1); j++) {
-                sum = sum
-                        + this->vallst.at(j - 1)
-                        * x[this->collst.at(j - 1) - 1];
+        this->checkCompacted();
+        int nrows = this->getRowCount();
+        auto& rowlst = this->rowsOf(0);
+        const int *collst = this->collst_lst[0].data();
+        const T *vallst = this->vallst_lst[0].data();
+        const T *xv = x.data();
+        const T defval = this->_defval;
+
+        // Cells which are not stored hold defval, so every row gets
+        // defval * sum(x) and stored cells only add their offset to it.
+        T base = T();
+        if (defval != T()) {
+            for (const T &xi : x) {
+                base += xi;
             }
+            base = defval * base;
+        }
 
-            result[i] = sum;
+        std::vector<T> result(nrows, base);
+        if (rowlst[nrows] == 0) { // only if any value set
+            return result;
+        }
+        size_t grain = nrows;
+        if (rowlst[nrows] >= SPMV_SERIAL_NNZ) {
+            grain = SPMV_ROW_GRAIN;
         }
+        parallel::forChunks(0, nrows, grain,
+                [&](size_t lo, size_t hi, size_t, unsigned) {
+                    for (size_t i = lo; i < hi; i++) {
+                        result[i] += rowDot(vallst, collst, rowlst[i],
+                                rowlst[i + 1], xv, defval);
+                    }
+                });
         return result;
     }
 
-    SparseMatrix<T> operator *(const SparseMatrix<T> & m) const {
-        if (this->_ncols != m._nrows) {
+    /*
+     Row wise (Gustavson) product. Row i of result is the sum of rows k of m
+     scaled by a[i][k], accumulated in a dense row buffer with a marker so
+     only touched columns are visited. Work is O(flops) and rows are split
+     across threads, each building its own part of CSR which is stitched
+     together at the end.
+
+     With non zero defaults A = Sa + da and B = Sb + db, where S only holds
+     the offset of stored cells. Then
+     C[i][j] = (Sa*Sb)[i][j] + db*rowsum(Sa)[i] + da*colsum(Sb)[j] + da*db*K
+     which is dense in general, so such products fill every row.
+     */
+    SparseMatrix<T> operator *(const SparseMatrix<T> & m) && {
+        // Operand storage cannot hold the product, same as const & case.
+        // Needed so (a * b) * c does not pick the element wise && product
+        // of MultiDim.
+        return static_cast<const SparseMatrix<T> &>(*this) * m;
+    }
+
+    SparseMatrix<T> operator *(const SparseMatrix<T> & m) const & {
+        if (this->getColumnCount() != m.getRowCount()) {
             throw InvalidDimensionsException(
                     "Cannot multiply: Left matrix column count and right matrix row count don't match.");
         }
+        this->checkCompacted();
+        m.checkCompacted();
+        int nrows = this->getRowCount();
+        int ncols = m.getColumnCount();
+        int inner = this->getColumnCount();
+        SparseMatrix<T> result(nrows, ncols);
 
-        SparseMatrix<T> result(this->_nrows, m._ncols);
-        T a;
+        auto& arow = this->rowsOf(0);
+        auto& acol = this->collst_lst[0];
+        auto& aval = this->vallst_lst[0];
+        auto& brow = m.rowsOf(0);
+        auto& bcol = m.collst_lst[0];
+        auto& bval = m.vallst_lst[0];
+        const T da = this->_defval;
+        const T db = m._defval;
+        const bool general = (da != T()) || (db != T());
 
-        // TODO: more efficient?
-        // @see http://www.math.tamu.edu/~srobertp/Courses/Math639_2014_Sp/CRSDescription/CRSStuff.pdf
-
-        for (int i = 1; i <= this->_nrows; i++) {
-            for (int j = 1; j <= m._ncols; j++) {
-                a = T();
-
-                for (int k = 1; k <= this->_ncols; k++) {
-                    a = a + this->get(i, k) * m.get(k, j);
+        std::vector<T> rowsum_a, colsum_b;
+        T kab = T();
+        if (general) {
+            rowsum_a.assign(nrows, T());
+            colsum_b.assign(ncols, T());
+            for (int i : patch::xrange(nrows)) {
+                for (int p = arow[i]; p < arow[i + 1]; p++) {
+                    rowsum_a[i] += aval[p] - da;
                 }
-
-                result.set(a, i, j);
             }
+            for (size_t q = 0; q < bval.size(); q++) {
+                colsum_b[bcol[q]] += bval[q] - db;
+            }
+            kab = da * db * static_cast<T>(inner);
+        }
+
+        size_t grain = nrows;
+        if (general || arow[nrows] >= SPGEMM_SERIAL_NNZ) {
+            grain = SPGEMM_ROW_GRAIN;
         }
+        size_t nchunk = parallel::chunkCount(0, nrows, grain);
+        std::vector<std::vector<int> > cols(nchunk);
+        std::vector<std::vector<T> > vals(nchunk);
+        std::vector<int> rowcnt(nrows, 0);
+        // Dense row buffers are per worker, not per chunk. Marker holds the
+        // row which last touched a column, rows are unique across chunks so
+        // markers never need a reset. Buffers are only allocated by
+        // workers which get a chunk.
+        unsigned nworker = parallel::workerCount();
+        std::vector<std::vector<T> > wacc(nworker);
+        std::vector<std::vector<int> > wmarker(nworker);
+        std::vector<std::vector<int> > wtouched(nworker);
 
+        parallel::forChunks(0, nrows, grain,
+                [&](size_t lo, size_t hi, size_t c, unsigned w) {
+                    auto& acc = wacc[w];
+                    auto& marker = wmarker[w];
+                    auto& touched = wtouched[w];
+                    if (marker.empty()) {
+                        acc.resize(ncols);
+                        marker.assign(ncols, -1);
+                    }
+                    auto& ccol = cols[c];
+                    auto& cval = vals[c];
+                    for (size_t i = lo; i < hi; i++) {
+                        touched.clear();
+                        for (int p = arow[i]; p < arow[i + 1]; p++) {
+                            T a = aval[p] - da;
+                            int k = acol[p];
+                            for (int q = brow[k]; q < brow[k + 1]; q++) {
+                                int j = bcol[q];
+                                if (marker[j] != (int) i) {
+                                    marker[j] = i;
+                                    acc[j] = a * (bval[q] - db);
+                                    touched.push_back(j);
+                                } else {
+                                    acc[j] += a * (bval[q] - db);
+                                }
+                            }
+                        }
+                        size_t before = ccol.size();
+                        if (!general) {
+                            std::sort(touched.begin(), touched.end());
+                            for (int j : touched) {
+                                if (acc[j] != T()) {
+                                    ccol.push_back(j);
+                                    cval.push_back(acc[j]);
+                                }
+                            }
+                        } else {
+                            T rbase = db * rowsum_a[i] + kab;
+                            for (int j = 0; j < ncols; j++) {
+                                T v = rbase + da * colsum_b[j];
+                                if (marker[j] == (int) i) {
+                                    v += acc[j];
+                                }
+                                if (v != T()) {
+                                    ccol.push_back(j);
+                                    cval.push_back(v);
+                                }
+                            }
+                        }
+                        rowcnt[i] = ccol.size() - before;
+                    }
+                });
+
+        auto& rrow = result.rowsFor(0);
+        auto& rcol = result.collst_lst[0];
+        auto& rval = result.vallst_lst[0];
+        for (int i : patch::xrange(nrows)) {
+            rrow[i + 1] = rrow[i] + rowcnt[i];
+        }
+        rcol.reserve(rrow[nrows]);
+        rval.reserve(rrow[nrows]);
+        for (size_t c = 0; c < nchunk; c++) {
+            rcol.insert(rcol.end(), cols[c].begin(), cols[c].end());
+            rval.insert(rval.end(), vals[c].begin(), vals[c].end());
+        }
+        result.releaseIfEmpty(0);
         return result;
     }
 
@@ -133,6 +308,32 @@ protected:
     void deepCopy(const SparseMatrix<T> & m);
     void validateCoordinates(int row, int col) const;
 
+private:
+    // Below these many stored values threads cost more than they save.
+    static const int SPMV_SERIAL_NNZ = 1 << 15;
+    static const int SPMV_ROW_GRAIN = 1024;
+    static const int SPGEMM_SERIAL_NNZ = 1 << 12;
+    static const int SPGEMM_ROW_GRAIN = 64;
+
+    // Sum of (val - defval) * x[col] over one row. Four independent
+    // accumulators break the add dependency chain so the compiler can keep
+    // several gathers in flight / use vector registers.
+    static inline T rowDot(const T *vallst, const int *collst, int lo, int hi,
+            const T *x, const T &defval) {
+        T s0 = T(), s1 = T(), s2 = T(), s3 = T();
+        int p = lo;
+        for (; p + 3 < hi; p += 4) {
+            s0 += (vallst[p] - defval) * x[collst[p]];
+            s1 += (vallst[p + 1] - defval) * x[collst[p + 1]];
+            s2 += (vallst[p + 2] - defval) * x[collst[p + 2]];
+            s3 += (vallst[p + 3] - defval) * x[collst[p + 3]];
+        }
+        for (; p < hi; p++) {
+            s0 += (vallst[p] - defval) * x[collst[p]];
+        }
+        return (s0 + s1) + (s2 + s3);
+    }
+
 };
 
 #endif
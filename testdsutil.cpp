@@ -1,26 +1,17 @@
 #include <cassert>
+#include <cstddef>
 #include <ctime>       /* time */
 #include "src/sparseDim.tpp"
-#include "src/sultiDim.tpp"
+#include "src/multiDim.tpp"
 #include "src/sparseMatrix.tpp"
+#include "src/sparseDimView.tpp"
+#include "src/journaledDim.tpp"
+#include "src/compactDim.tpp"
+#include "generators.h"
 
 
 using namespace std;
 
-SparseMatrix<int> generateIntMatrix(int rows, int columns) {
-    SparseMatrix<int> matrix(rows, columns);
-
-    for (int i =0; i <rows; i++) {
-        for (int j = 0; j< columns; j++)) {
-            auto val = rand() % 101;
-            if (val > 20)
-                val = 0;
-            matrix.set(val, i, j);
-        }
-    }
-    return matrix;
-}
-
 void read_write2() {
     SparseMatrix<int> m1 = generateIntMatrix(500, 510);
     SparseMatrix<int> m2 = generateIntMatrix(510, 500);
@@ -34,6 +25,8 @@ void read_write2() {
     m2.dump("test2.bin");
     SparseMatrix<int> m12 = SparseMatrix<int>::load("test2.bin", err);
     assert(m12 == m2);
+    remove("test1.bin");
+    remove("test2.bin");
 }
 
 struct foo7 {
@@ -63,31 +56,86 @@ void basic_operation2() {
     assert(m2.oper(isOdd()) == m2 % 2);
 }
 
-template<int N>
-SparseDim<int, N> generateIntNDimArr(array<int, N> arr) {
-    SparseDim<int, N> sd(arr);
-    for (std::array<int, N> _arr : mdrange<N>(arr)) {
-        int val = rand() % 101;
-        if (val > 20)
-            val = 0;
-        sd.set(val, _arr);
+void multiply2() {
+    SparseMatrix<int> m1 = generateIntMatrix(60, 70);
+    SparseMatrix<int> m2 = generateIntMatrix(70, 50);
+    // Non zero default value takes the dense correction path
+    SparseMatrix<int> m3 = m2 * 1 + 3;
+
+    SparseMatrix<int> p12 = m1 * m2;
+    SparseMatrix<int> p13 = m1 * m3;
+    for (int i = 0; i < 60; i++) {
+        for (int j = 0; j < 50; j++) {
+            int a = 0, b = 0;
+            for (int k = 0; k < 70; k++) {
+                a += m1.get(i, k) * m2.get(k, j);
+                b += m1.get(i, k) * m3.get(k, j);
+            }
+            assert(p12.get(i, j) == a);
+            assert(p13.get(i, j) == b);
+        }
+    }
+    // Chained product of a temporary, result moved into existing matrix
+    SparseMatrix<int> m5 = generateIntMatrix(50, 40);
+    SparseMatrix<int> chain(1, 1);
+    chain = (m1 * m2) * m5;
+    assert(chain == p12 * m5);
+    chain = p12 + p12;
+    assert(chain == p12 * 2);
+    // A MultiDim operand converts to SparseMatrix, no element wise product
+    SparseMatrix<int> m6 = generateIntMatrix(70, 50);
+    SparseMatrix<int> sum26 = m2 + m6;
+    assert(m1 * (m2 + m6) == m1 * sum26);
+    MultiDim<int, 2U> md26 = m2 + m6;
+    assert(m1 * md26 == m1 * sum26);
+    SparseMatrix<int> inplace(m1);
+    inplace *= sum26;
+    assert(inplace == m1 * sum26);
+    {
+        SparseMatrix<int> a(2, 2), b(2, 2), c(2, 2);
+        a.set(1, 0, 0);
+        a.set(1, 0, 1);
+        a.set(2, 1, 0);
+        a.set(3, 1, 1);
+        b.set(1, 0, 0);
+        c.set(1, 1, 1);
+        c.set(2, 0, 1);
+        SparseMatrix<int> p = a * (b + c);
+        assert(p.get(0, 0) == 1 && p.get(0, 1) == 3);
+        assert(p.get(1, 0) == 2 && p.get(1, 1) == 7);
     }
-    return sd;
-}
 
-template<int N>
-array<int, N> getRandomIndex(array<int, N> sz) {
-    for (int i =0; i<N; i++) {
-        sz[i] = (sz[i] != 1) ? rand() % sz[i] : 0;
+    // Row chunks on several workers give the serial product
+    SparseMatrix<int> big1 = generateIntMatrix(400, 200);
+    SparseMatrix<int> big2 = generateIntMatrix(200, 150) + 1;
+    SparseMatrix<int> serial = big1 * big2;
+    parallel::setThreadCount(4);
+    assert(big1 * big2 == serial);
+    parallel::setThreadCount(0);
+
+    vector<int> x(70);
+    for (int k = 0; k < 70; k++) {
+        x[k] = rand() % 11 - 5;
+    }
+    SparseMatrix<int> m4 = m1 * 1 - 2;
+    vector<int> y1 = m1 * x;
+    vector<int> y4 = m4 * x;
+    for (int i = 0; i < 60; i++) {
+        int a = 0, b = 0;
+        for (int k = 0; k < 70; k++) {
+            a += m1.get(i, k) * x[k];
+            b += m4.get(i, k) * x[k];
+        }
+        assert(y1[i] == a);
+        assert(y4[i] == b);
     }
-    return sz;
 }
 
 void set_getND() {
     {
         array<int, 5> arr1 = { { 40, 50, 30, 40, 70 } };
         SparseDim<int, 5> sd(arr1);
-        for (int i=0 ; i< 500; i++)) {
+        for (int i=0 ; i< 500; i++) {
             UNUSED(i);
             auto dim = getRandomIndex<5>(arr1);
             int val = rand() % 100;
@@ -127,6 +175,69 @@ void set_getND() {
     std::cout << "Case 3: SetGet done " << endl;
 }
 
+void buffered_set_getND() {
+    array<int, 4> arr = { { 6, 5, 20, 30 } };
+    SparseDim<int, 4> ref = generateIntNDimArr<4>(arr);
+    SparseDim<int, 4> sd(ref);
+    sd.enableWriteBuffer(300);
+    for (int i = 0; i < 2000; i++) {
+        auto dim = getRandomIndex<4>(arr);
+        // Some writes are default value which removes the cell
+        int val = rand() % 10;
+        ref.set(val, dim);
+        sd.set(val, dim);
+        assert(sd.get(dim) == val);
+    }
+    assert(sd.pendingWrites() > 0);
+    sd.compact();
+    assert(sd.pendingWrites() == 0);
+    assert(sd == ref);
+    sd.disableWriteBuffer();
+
+    // Many slices touched by one compact keep capacity near their size
+    array<int, 3> wide = { { 2000, 8, 8 } };
+    SparseDim<int, 3> direct(wide), buffered(wide);
+    buffered.enableWriteBuffer(1 << 20);
+    for (int i = 0; i < 12000; i++) {
+        auto dim = getRandomIndex<3>(wide);
+        direct.set(1 + i % 9, dim);
+        buffered.set(1 + i % 9, dim);
+    }
+    buffered.compact();
+    assert(buffered == direct);
+    assert(buffered.memoryUsage() <= direct.memoryUsage() * 11 / 10);
+    std::cout << "Buffered SetGet done " << endl;
+}
+
+void bulk_loadND() {
+    array<int, 4> arr = { { 5, 4, 30, 20 } };
+    vector<array<int, 4> > coords;
+    vector<int> vals;
+    SparseDim<int, 4> last(arr), total(arr);
+    for (int i = 0; i < 5000; i++) {
+        auto dim = getRandomIndex<4>(arr);
+        int val = rand() % 10;
+        coords.push_back(dim);
+        vals.push_back(val);
+        last.set(val, dim);
+        total.set(total.get(dim) + val, dim);
+    }
+    SparseDim<int, 4> sd1(arr, coords.begin(), coords.end(), vals.begin());
+    assert(sd1 == last);
+    MultiDim<int, 4> sd2(arr, coords.begin(), coords.end(), vals.begin(), 0,
+            [](int a, int b) {return a + b;});
+    assert(sd2 == total);
+
+    vector<pair<array<int, 4>, int> > entries;
+    for (size_t i = 0; i < coords.size(); i++) {
+        entries.push_back(make_pair(coords[i], vals[i]));
+    }
+    SparseDim<int, 4> sd3 = SparseDim<int, 4>::fromEntries(arr,
+            entries.begin(), entries.end());
+    assert(sd3 == last);
+    std::cout << "Bulk load done " << endl;
+}
+
 void basic_operationND() {
     {
         array<int, 3> arr = { { 2, 4, 4 } };
@@ -159,6 +270,63 @@ void basic_operationND() {
     cout << "Case 2: Operations Done " << endl;
 }
 
+void merge_operationND() {
+    array<int, 4> arr = { { 3, 4, 6, 7 } };
+    MultiDim<int, 4> m1 = generateIntNDimArr<4>(arr);
+    MultiDim<int, 4> m2 = generateIntNDimArr<4>(arr);
+    // Non zero defaults on both sides
+    MultiDim<int, 4> m3 = m1 + 3;
+    MultiDim<int, 4> m4 = m2 - 2;
+
+    MultiDim<int, 4> sum = m3 + m4;
+    MultiDim<int, 4> dif = m3 - m4;
+    MultiDim<int, 4> prd = m3 * m4;
+    MultiDim<int, 4> lo = m3.min(m4);
+    MultiDim<int, 4> hi = m3.max(m4);
+    for (auto idx : mdrange<4>(arr)) {
+        int a = m3.get(idx), b = m4.get(idx);
+        assert(sum.get(idx) == a + b);
+        assert(dif.get(idx) == a - b);
+        assert(prd.get(idx) == a * b);
+        assert(lo.get(idx) == std::min(a, b));
+        assert(hi.get(idx) == std::max(a, b));
+    }
+
+    MultiDim<int, 4> acc(m3);
+    acc += m4;
+    assert(acc == sum);
+    acc -= m4;
+    assert(acc == m3);
+    assert((m3 + m4 - m4) == m3);
+    assert(((m3 - m4) * 2) == (dif + dif));
+    cout << "Merge Operations Done " << endl;
+}
+
+void parallel_operationND() {
+    array<int, 4> arr = { { 30, 4, 9, 12 } };
+    MultiDim<int, 4> m1 = generateIntNDimArr<4>(arr);
+    MultiDim<int, 4> m2 = MultiDim<int, 4>(generateIntNDimArr<4>(arr)) - 1;
+    MultiDim<int, 4> sum = m1 + m2;
+    MultiDim<int, 4> times7 = m1.oper([](int &i) {i*=7;});
+    MultiDim<int, 4> odd = m2 % 2;
+    SparseMatrix<int> a = generateIntMatrix(200, 150);
+    SparseMatrix<int> b = generateIntMatrix(150, 120);
+    SparseMatrix<int> ab = a * b;
+
+    // Force pool on every operation, also on single core machines
+    parallel::setThreadCount(4);
+    parallel::setSerialLimit(1);
+    MultiDim<int, 4> copy(m1);
+    assert(copy == m1);
+    assert((m1 + m2) == sum);
+    assert(m1.oper([](int &i) {i*=7;}) == times7);
+    assert((m2 % 2) == odd);
+    assert((a * b) == ab);
+    parallel::setThreadCount(0);
+    parallel::setSerialLimit(1 << 14);
+    cout << "Parallel Operations Done " << endl;
+}
+
 void read_writeND() {
     array<int, 5> arr = { { 20, 3, 7, 8, 9 } };
     SparseDim<int, 5> m1 = generateIntNDimArr<5>(arr);
@@ -173,14 +341,474 @@ void read_writeND() {
     m2.dump("_test2.bin");
     SparseDim<int, 5> m12 = SparseDim<int, 5>::load("_test2.bin", err);
     assert(m12 == m2);
+
+    // Slices without values still get a full row list in the file
+    SparseDim<int, 5> sparse(arr);
+    sparse.set(4, { { 3, 1, 2, 5, 6 } });
+    sparse.dump("_test2.bin");
+    ifstream fin("_test2.bin", ios::in | ios::binary);
+    int32_t nlst, nrows;
+    fin.seekg(sizeof(int) + sizeof(int) + 5 * sizeof(int));
+    fin.read(reinterpret_cast<char*>(&nlst), sizeof(nlst));
+    assert(nlst == 20 * 3 * 7);
+    for (int i = 0; i < nlst; i++) {
+        fin.read(reinterpret_cast<char*>(&nrows), sizeof(nrows));
+        assert(fin && nrows == 8 + 1);
+        fin.seekg(nrows * sizeof(int32_t), ios::cur);
+    }
+    fin.close();
+    remove("_test1.bin");
+    remove("_test2.bin");
+}
+
+void mapped_readND() {
+    array<int, 5> arr = { { 20, 3, 7, 8, 9 } };
+    MultiDim<int, 5> m1 = generateIntNDimArr<5>(arr);
+    // Non zero default and some empty slices
+    MultiDim<int, 5> m2 = m1 + 4;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 8; j++) {
+            for (int k = 0; k < 9; k++) {
+                m2.set(4, { { 5, i, 2, j, k } });
+            }
+        }
+    }
+    assert(m2.dumpMapped("_test3.bin") == 0);
+    int err;
+    SparseDimView<int, 5> view("_test3.bin", err);
+    assert(err == 0 && view.valid());
+    for (auto idx : mdrange<5>(arr)) {
+        assert(view.get(idx) == m2.get(idx));
+    }
+    size_t count = 0;
+    view.forEachNonzero([&](const array<int, 5> &idx, int val) {
+        assert(m2.get(idx) == val);
+        count++;
+    });
+    assert(count == view.nnz());
+    view.prefetch(3);
+    assert(view.toSparseDim() == m2);
+
+    SparseDimView<int, 4> wrong("_test3.bin", err);
+    assert(err == 5 && !wrong.valid());
+    // Failed open has nothing to read, every access throws
+    int refused = 0;
+    try {
+        wrong.prefetch(0);
+    } catch (const InvalidStateException &) {
+        refused++;
+    }
+    try {
+        wrong.forEachNonzero(0, [](const array<int, 4> &, int) {});
+    } catch (const InvalidStateException &) {
+        refused++;
+    }
+    try {
+        wrong.toSparseDim();
+    } catch (const InvalidStateException &) {
+        refused++;
+    }
+    assert(refused == 3);
+    try {
+        view.prefetch(view.getVirtualDimSize());
+        assert(false);
+    } catch (const InvalidCoordinatesException &) {
+    }
+
+    // Damaged offsets or slice table are refused, not read out of bounds
+    MappedHeader h;
+    {
+        ifstream fin("_test3.bin", ios::in | ios::binary);
+        fin.read(reinterpret_cast<char*>(&h), sizeof(h));
+    }
+    auto patched = [&](size_t at, uint64_t val) {
+        fstream f("_test3.bin", ios::in | ios::out | ios::binary);
+        uint64_t old;
+        f.seekg(at);
+        f.read(reinterpret_cast<char*>(&old), sizeof(old));
+        f.seekp(at);
+        f.write(reinterpret_cast<const char*>(&val), sizeof(val));
+        f.close();
+        SparseDimView<int, 5> bad("_test3.bin", err);
+        f.open("_test3.bin", ios::in | ios::out | ios::binary);
+        f.seekp(at);
+        f.write(reinterpret_cast<const char*>(&old), sizeof(old));
+        return err;
+    };
+    assert(patched(offsetof(MappedHeader, sliceoff), h.filesize + 64) == 3);
+    assert(patched(offsetof(MappedHeader, coloff), h.rowoff - 64) == 3);
+    assert(patched(h.sliceoff + 3 * sizeof(MappedSlice), 1u << 30) == 3);
+    assert(patched(h.sliceoff + 20 * 3 * 7 * sizeof(MappedSlice), 1) == 3);
+    SparseDimView<int, 5> again("_test3.bin", err);
+    assert(err == 0 && again.toSparseDim() == m2);
+    remove("_test3.bin");
+    std::cout << "Mapped read done " << endl;
+}
+
+struct Point {
+    int x, y;
+    bool operator ==(const Point &o) const {
+        return x == o.x && y == o.y;
+    }
+    bool operator !=(const Point &o) const {
+        return !(*this == o);
+    }
+    friend ostream & operator <<(ostream &os, const Point &p) {
+        return os << p.x << ":" << p.y;
+    }
+};
+
+void compactND() {
+    array<int, 4> arr = { { 30, 20, 16, 16 } };
+    SparseDim<int, 4> sd(arr, -1);
+    // Few slices used, values repeat
+    for (int i = 0; i < 400; i++) {
+        array<int, 4> dim = getRandomIndex<4>(arr);
+        dim[0] = dim[0] % 3;
+        sd.set(rand() % 5, dim);
+    }
+    CompactDim<int, 4, IndexFor<16, 16>::type> raw(sd);
+    CompactDim<int, 4, IndexFor<16, 16>::type> dict(sd, true);
+    assert(!raw.dictionaryEncoded() && dict.dictionaryEncoded());
+    assert(raw.memoryUsage() < sd.memoryUsage());
+    for (int i = 0; i < 2000; i++) {
+        auto dim = getRandomIndex<4>(arr);
+        assert(raw.get(dim) == sd.get(dim));
+        assert(dict.get(dim) == sd.get(dim));
+    }
+    size_t count = 0;
+    dict.forEachNonzero([&](const array<int, 4> &idx, int val) {
+        assert(sd.get(idx) == val);
+        count++;
+    });
+    assert(count == dict.nnz());
+    assert(dict.toSparseDim() == sd);
+
+    // More distinct values than 16 bit codes, nothing of the dictionary kept
+    array<int, 3> wide = { { 2, 300, 300 } };
+    SparseDim<int, 3> distinct(wide);
+    int next = 1;
+    for (auto idx : mdrange<3>(wide)) {
+        distinct.set(next++, idx);
+    }
+    CompactDim<int, 3> rawwide(distinct);
+    CompactDim<int, 3> dictwide(distinct, true);
+    assert(!dictwide.dictionaryEncoded());
+    assert(dictwide.memoryUsage() == rawwide.memoryUsage());
+    assert(dictwide.toSparseDim() == distinct);
+
+    // Empty slices hold no lists, a slice emptied by set gives them back
+    array<int, 4> big = { { 100, 100, 64, 64 } };
+    SparseDim<int, 4> lazy(big);
+    size_t empty = lazy.memoryUsage();
+    assert(empty < 3 * 10000 * sizeof(vector<int>) + 4096);
+    array<int, 4> at = { { 7, 9, 3, 5 } };
+    lazy.set(4, at);
+    assert(lazy.memoryUsage() > empty && lazy.get(at) == 4);
+    lazy.set(0, at);
+    assert(lazy.memoryUsage() == empty && lazy.get(at) == 0);
+
+    // Values without std::hash are kept raw
+    array<int, 3> ptdims = { { 3, 4, 5 } };
+    array<int, 3> ptat = { { 1, 2, 3 } };
+    SparseDim<Point, 3> pts(ptdims);
+    pts.set(Point { 1, 2 }, ptat);
+    CompactDim<Point, 3> cpts(pts, true);
+    assert(!cpts.dictionaryEncoded());
+    assert(cpts.get(ptat) == (Point { 1, 2 }));
+    std::cout << "Compact layout done " << endl;
+}
+
+void region_queryND() {
+    array<int, 4> arr = { { 5, 4, 12, 10 } };
+    SparseDim<int, 4> sd(arr, 2);
+    for (int i = 0; i < 900; i++) {
+        sd.set(rand() % 50 - 20, getRandomIndex<4>(arr));
+    }
+    size_t count = 0;
+    for (auto& e : sd.nonzeros()) {
+        assert(sd.get(e.coord) == e.value);
+        count++;
+    }
+    size_t stored = 0;
+    sd.forEachNonzero([&](const array<int, 4> &, int) {stored++;});
+    assert(count == stored && count > 0);
+
+    array<int, 4> start = { { 1, 1, 3, 2 } };
+    array<int, 4> end = { { 4, 3, 11, 7 } };
+    long sum = 0;
+    int mn = 1000, mx = -1000;
+    for (auto idx : mdrange<4>(start, end)) {
+        int val = sd.get(idx);
+        sum += val;
+        mn = std::min(mn, val);
+        mx = std::max(mx, val);
+    }
+    auto st = sd.stats(start, end);
+    assert(st.sum == sum && st.min == mn && st.max == mx);
+    assert(st.cells == 3 * 2 * 8 * 5);
+    size_t inregion = 0;
+    sd.forEachInRegion(start, end, [&](const array<int, 4> &, int) {
+        inregion++;
+    });
+    assert(inregion == st.count);
+
+    // Parallel partials give same result
+    parallel::setThreadCount(4);
+    parallel::setSerialLimit(1);
+    assert(sd.sum() == sd.stats().sum);
+    for (unsigned axis = 0; axis < 4; axis++) {
+        std::vector<int> along = sd.sumAlong(axis);
+        auto st = sd.statsAlong(axis);
+        std::vector<int> brute(arr[axis], 0), bmin(arr[axis], 1000),
+                bmax(arr[axis], -1000);
+        std::vector<size_t> bcount(arr[axis], 0);
+        for (auto idx : mdrange<4>(arr)) {
+            int val = sd.get(idx);
+            brute[idx[axis]] += val;
+            bmin[idx[axis]] = std::min(bmin[idx[axis]], val);
+            bmax[idx[axis]] = std::max(bmax[idx[axis]], val);
+            bcount[idx[axis]] += (val != 2);
+        }
+        assert(along == brute);
+        for (int i = 0; i < arr[axis]; i++) {
+            assert(st[i].sum == brute[i] && st[i].count == bcount[i]);
+            assert(st[i].min == bmin[i] && st[i].max == bmax[i]);
+        }
+    }
+    parallel::setThreadCount(0);
+    parallel::setSerialLimit(1 << 14);
+
+    // Different defaults, compared by value
+    array<int, 4> small = { { 2, 2, 3, 3 } };
+    SparseDim<int, 4> full(small, 0), empty(small, 7);
+    for (auto idx : mdrange<4>(small)) {
+        full.set(7, idx);
+    }
+    assert(full == empty);
+    array<int, 4> one = { { 1, 1, 2, 0 } };
+    full.set(0, one);
+    assert(!(full == empty));
+    std::cout << "Region query done " << endl;
+}
+
+void countersND() {
+    array<int, 3> arr = { { 3, 10, 12 } };
+    SparseDim<int, 3> sd(arr);
+    for (int i = 0; i < 200; i++) {
+        sd.set(1 + rand() % 9, getRandomIndex<3>(arr));
+    }
+    sd.get(getRandomIndex<3>(arr));
+    sd.dump("_test3.bin");
+    PerfCounters c = sd.counters();
+#ifdef MDSPARSE_COUNTERS
+    assert(c.probes == 201 && c.shifts > 0 && c.allocations > 0);
+    assert(c.byteswritten > 0);
+#else
+    assert(c.probes == 0 && c.shifts == 0 && c.byteswritten == 0);
+#endif
+    sd.resetCounters();
+    assert(sd.counters().probes == 0);
+    remove("_test3.bin");
+
+    SparseDim<int, 3> copy(sd);
+    MultiDim<int, 3> sum = MultiDim<int, 3>(sd) + MultiDim<int, 3>(sd);
+    array<int, 3> at = { { 1, 2, 3 } };
+    {
+        JournaledDim<int, 3> jd(arr, "_test6");
+        jd.set(5, at);
+        jd.checkpoint();
+#ifdef MDSPARSE_COUNTERS
+        assert(copy.counters().allocations > 3);
+        assert(sum.counters().allocations > 0);
+        assert(jd.counters().byteswritten > 0);
+#endif
+    }
+    remove("_test6.ckpt");
+    remove("_test6.jrnl");
+    std::cout << "Counters done " << endl;
+}
+
+void journalND() {
+    array<int, 4> arr = { { 6, 5, 8, 9 } };
+    MultiDim<int, 4> ref(arr, 1);
+    {
+        JournaledDim<int, 4> jd(arr, "_test4", 1);
+        jd.setBatchSize(16);
+        for (int round = 0; round < 3; round++) {
+            for (int i = 0; i < 300; i++) {
+                auto dim = getRandomIndex<4>(arr);
+                int val = rand() % 10;
+                ref.set(val, dim);
+                jd.set(val, dim);
+            }
+            assert(jd.dirtySlices() > 0);
+            jd.checkpoint();
+            assert(jd.dirtySlices() == 0);
+        }
+        // Not checkpointed, only in journal
+        for (int i = 0; i < 100; i++) {
+            auto dim = getRandomIndex<4>(arr);
+            int val = rand() % 10;
+            ref.set(val, dim);
+            jd.set(val, dim);
+        }
+        assert(jd.data() == ref);
+    }
+    int err;
+    JournaledDim<int, 4> jd = JournaledDim<int, 4>::recover("_test4", err);
+    assert(err == 0);
+    assert(jd.data() == ref);
+    jd.checkpoint();
+    JournaledDim<int, 4> jd2 = JournaledDim<int, 4>::recover("_test4", err);
+    assert(err == 0 && jd2.data() == ref);
+    remove("_test4.ckpt");
+    remove("_test4.jrnl");
+    std::cout << "Journal recovery done " << endl;
+}
+
+long fileSize(const string &path) {
+    ifstream fin(path.c_str(), ios::in | ios::binary | ios::ate);
+    return fin.tellg();
+}
+
+void journal_failuresND() {
+    array<int, 4> arr = { { 4, 3, 8, 9 } };
+    MultiDim<int, 4> ref(arr), before(arr);
+    int err;
+    {
+        JournaledDim<int, 4> jd(arr, "_test5");
+        jd.setBatchSize(1);
+        for (int i = 0; i < 200; i++) {
+            auto dim = getRandomIndex<4>(arr);
+            int val = 1 + rand() % 9;
+            before = ref;
+            ref.set(val, dim);
+            jd.set(val, dim);
+        }
+    }
+    // Last journal record torn in the middle, it is dropped
+    assert(truncate("_test5.jrnl", fileSize("_test5.jrnl") - 3) == 0);
+    {
+        JournaledDim<int, 4> jd = JournaledDim<int, 4>::recover("_test5", err);
+        assert(err == 0 && jd.data() == before);
+        ref = before;
+        jd.checkpoint();
+    }
+
+    // Slice segment cut before its commit mark is ignored
+    {
+        ofstream fout("_test5.ckpt", ios::out | ios::binary | ios::app);
+        uint32_t tag = 0x53;
+        uint64_t v = 1, nnz = 5;
+        fout.write(reinterpret_cast<const char*>(&tag), sizeof(tag));
+        fout.write(reinterpret_cast<const char*>(&v), sizeof(v));
+        fout.write(reinterpret_cast<const char*>(&nnz), sizeof(nnz));
+        fout.write("torn", 4);
+    }
+    {
+        JournaledDim<int, 4> jd = JournaledDim<int, 4>::recover("_test5", err);
+        assert(err == 0 && jd.data() == ref);
+        // Torn tail was cut, new segments are readable after it
+        array<int, 4> at = { { 1, 2, 3, 4 } };
+        ref.set(7, at);
+        jd.set(7, at);
+        jd.checkpoint();
+    }
+    {
+        JournaledDim<int, 4> jd = JournaledDim<int, 4>::recover("_test5", err);
+        assert(err == 0 && jd.data() == ref);
+
+        // Same slices over and over, file is rewritten instead of growing
+        jd.setRewriteSlack(0);
+        long first = 0;
+        for (int round = 0; round < 10; round++) {
+            for (int i = 0; i < 50; i++) {
+                auto dim = getRandomIndex<4>(arr);
+                dim[0] = 0;
+                int val = 1 + rand() % 9;
+                ref.set(val, dim);
+                jd.set(val, dim);
+            }
+            jd.checkpoint();
+            if (!round) {
+                first = fileSize("_test5.ckpt");
+            }
+        }
+        assert(fileSize("_test5.ckpt") < 3 * first);
+    }
+    array<int, 4> at0 = { { 0, 0, 0, 0 } };
+    {
+        JournaledDim<int, 4> jd = JournaledDim<int, 4>::recover("_test5", err);
+        assert(err == 0 && jd.data() == ref);
+        ref.set(9, at0);
+        jd.set(9, at0);
+        jd.checkpoint();
+    }
+
+    // Zero filled journal tail is not replayed as set(0, {0, .., 0})
+    {
+        ofstream fout("_test5.jrnl", ios::out | ios::binary | ios::app);
+        vector<char> zeros(64, 0);
+        fout.write(zeros.data(), zeros.size());
+    }
+    {
+        JournaledDim<int, 4> jd = JournaledDim<int, 4>::recover("_test5", err);
+        assert(err == 0 && jd.data() == ref && jd.get(at0) == 9);
+        before = ref;
+        for (int i = 0; i < 20; i++) {
+            auto dim = getRandomIndex<4>(arr);
+            ref.set(1 + rand() % 9, dim);
+            jd.set(ref.get(dim), dim);
+        }
+        jd.checkpoint();
+    }
+
+    // Committed segment with a damaged byte is dropped as a whole
+    {
+        fstream f("_test5.ckpt", ios::in | ios::out | ios::binary);
+        f.seekg(fileSize("_test5.ckpt") - 20);
+        char c = f.get();
+        f.seekp(fileSize("_test5.ckpt") - 20);
+        f.put(c ^ 0x10);
+    }
+    {
+        JournaledDim<int, 4> jd = JournaledDim<int, 4>::recover("_test5", err);
+        assert(err == 0 && jd.data() == before);
+    }
+
+    // Store from a failed recover refuses writes
+    JournaledDim<int, 4> none = JournaledDim<int, 4>::recover("_nofile", err);
+    assert(err == 1);
+    bool thrown = false;
+    try {
+        none.set(1, array<int, 4> { { 0, 0, 0, 0 } });
+    } catch (const InvalidStateException &) {
+        thrown = true;
+    }
+    assert(thrown);
+    remove("_test5.ckpt");
+    remove("_test5.jrnl");
+    std::cout << "Journal failures done " << endl;
 }
 
 int main() {
     srand(time(NULL));
     read_write2();
     basic_operation2();
+    multiply2();
     set_getND();
+    buffered_set_getND();
+    bulk_loadND();
     basic_operationND();
+    merge_operationND();
+    parallel_operationND();
     read_writeND();
+    mapped_readND();
+    journalND();
+    journal_failuresND();
+    compactND();
+    region_queryND();
+    countersND();
     return 0;
 }
\ No newline at end of file